@@ -5,34 +5,40 @@
 #include "backends/rtlil/rtlil_backend.h"
 #include "util.h"
 
+#include "thread_pool.h"
+
 
 USING_YOSYS_NAMESPACE  // Does "using namespace"
 
 
 DriverBit::DriverBit(RTLIL::Cell *cell, const RTLIL::IdString& port) :
-        wire(nullptr), cell(cell), port(port), offset(0)
+        port(port), offset(0)
 {
         log_assert(cell != nullptr && !port.empty() &&
                    cell->hasPort(port) && cell->getPort(port).size() == 1);
+        set_cell(cell);
 }
 
 
 DriverBit::DriverBit(RTLIL::Cell *cell, const RTLIL::IdString& port, int offset) :
-        wire(nullptr), cell(cell), port(port), offset(offset)
+        port(port), offset(offset)
 {
         log_assert(cell != nullptr && !port.empty() && cell->hasPort(port));
+        set_cell(cell);
 }
 
 DriverBit::DriverBit(const DriverChunk &chunk) :
-        wire(chunk.wire), cell(chunk.cell), port(chunk.port)
+        port(chunk.port), offset(0)
 {
         log_assert(chunk.width == 1);
+        set_object(chunk.wire, chunk.cell);
         if (chunk.is_object()) offset = chunk.offset; else data = chunk.data[0];
 }
 
 DriverBit::DriverBit(const DriverChunk &chunk, int index) :
-        wire(chunk.wire), cell(chunk.cell), port(chunk.port)
+        port(chunk.port), offset(0)
 {
+        set_object(chunk.wire, chunk.cell);
         if (chunk.is_object()) offset = chunk.offset + index; else data = chunk.data[index];
 }
 
@@ -41,7 +47,7 @@ DriverBit::DriverBit(const DriverChunk &chunk, int index) :
 bool DriverChunk::has_same_object(const DriverBit& bit) const
 {
         return is_object() &&
-               (bit.wire == wire && bit.cell == cell && bit.port == port);
+               (bit.wire() == wire && bit.cell() == cell && bit.port == port);
 }
 
 
@@ -100,7 +106,8 @@ DriverChunk::DriverChunk(RTLIL::Cell *cell, const RTLIL::IdString& port, int off
 	log_assert(!port.empty());
         log_assert(cell->hasPort(port));
 	this->wire = nullptr;
-        this->cell = nullptr;
+        this->cell = cell;
+        this->port = port;
 	this->width = width;
 	this->offset = offset;
 }
@@ -135,8 +142,8 @@ DriverChunk::DriverChunk(RTLIL::State bit, int width)
 
 DriverChunk::DriverChunk(const DriverBit &bit)
 {
-	wire = bit.wire;
-        cell = bit.cell;
+	wire = bit.wire();
+        cell = bit.cell();
         port = bit.port;
 	offset = 0;
 	if (is_data())
@@ -277,6 +284,7 @@ DriverSpec &DriverSpec::operator=(const DriverSpec &other)
 	hash_ = other.hash_;
 	chunks_ = other.chunks_;
 	bits_ = other.bits_;
+	chunk_ends_.clear();
 	return *this;
 }
 
@@ -408,7 +416,7 @@ DriverSpec::DriverSpec(const DriverBit &bit, int width)
 	cover("driverspec.init.bit");
 
 	if (width != 0) {
-		if (bit.wire == nullptr && bit.cell == nullptr)
+		if (bit.is_data())
 			chunks_.emplace_back(bit.data, width);
 		else
 			for (int i = 0; i < width; i++)
@@ -485,6 +493,7 @@ void DriverSpec::pack() const
 
 	std::vector<DriverBit> old_bits;
 	old_bits.swap(that->bits_);
+	that->chunk_ends_.clear();
 
 	DriverChunk *last = nullptr;
 	int last_end_offset = 0;
@@ -525,6 +534,7 @@ void DriverSpec::unpack() const
 			that->bits_.emplace_back(c, i);
 
 	that->chunks_.clear();
+	that->chunk_ends_.clear();
 	that->hash_ = 0;
 }
 
@@ -600,7 +610,7 @@ void DriverSpec::replace(const DriverSpec &pattern, const DriverSpec &with, Driv
 	other->unpack();
 
 	for (int i = 0; i < GetSize(pattern.bits_); i++) {
-		if (pattern.bits_[i].wire != nullptr || pattern.bits_[i].cell != nullptr) {
+		if (pattern.bits_[i].is_object()) {
 			for (int j = 0; j < GetSize(bits_); j++) {
 				if (bits_[j] == pattern.bits_[i]) {
 					other->bits_[j] = with.bits_[i];
@@ -680,32 +690,44 @@ void DriverSpec::remove2(const DriverSpec &pattern, DriverSpec *other)
 	else
 		cover("driverspec.remove");
 
-	unpack();
-	if (other != nullptr) {
+	if (other != nullptr)
 		log_assert(width_ == other->width_);
-		other->unpack();
-	}
 
-	for (int i = GetSize(bits_) - 1; i >= 0; i--)
-	{
-                DriverBit& b = bits_[i];  // for conciseness
-
-		if (!b.is_object()) continue;
-
-		for (auto &pchunk : pattern.chunks())
-			if ((b.wire == pchunk.wire || (b.cell == pchunk.cell && b.port == pchunk.port)) &&
-				b.offset >= pchunk.offset &&
-				b.offset < pchunk.offset + pchunk.width) {
-				bits_.erase(bits_.begin() + i);
-				width_--;
-				if (other != nullptr) {
-					other->bits_.erase(other->bits_.begin() + i);
-					other->width_--;
+	// Keep the parts of each chunk that no pattern chunk covers.
+	DriverSpec kept, other_kept;
+	int pos = 0;
+	for (auto &chunk : chunks()) {
+		std::vector<std::pair<int, int>> covered;  // Offsets within the object
+		if (chunk.is_object()) {
+			for (auto &pchunk : pattern.chunks()) {
+				if (pchunk.is_object() && pchunk.wire == chunk.wire &&
+				    pchunk.cell == chunk.cell && pchunk.port == chunk.port) {
+					int lo = std::max(chunk.offset, pchunk.offset);
+					int hi = std::min(chunk.offset + chunk.width, pchunk.offset + pchunk.width);
+					if (lo < hi)
+						covered.push_back({lo, hi});
 				}
-				break;
 			}
+			std::sort(covered.begin(), covered.end());
+		}
+
+		int next = chunk.offset;  // The first offset not yet kept or removed
+		covered.push_back({chunk.offset + chunk.width, chunk.offset + chunk.width});
+		for (auto &range : covered) {
+			if (range.first > next) {
+				kept.append(chunk.extract(next - chunk.offset, range.first - next));
+				if (other != nullptr)
+					other_kept.append(other->extract(pos + next - chunk.offset, range.first - next));
+			}
+			next = std::max(next, range.second);
+		}
+		pos += chunk.width;
 	}
 
+	*this = std::move(kept);
+	if (other != nullptr)
+		*other = std::move(other_kept);
+
 	check();
 }
 
@@ -727,24 +749,31 @@ void DriverSpec::remove2(const pool<DriverBit> &pattern, DriverSpec *other)
 	else
 		cover("driverspec.remove");
 
-	unpack();
-
-	if (other != nullptr) {
+	if (other != nullptr)
 		log_assert(width_ == other->width_);
-		other->unpack();
-	}
 
-	for (int i = GetSize(bits_) - 1; i >= 0; i--) {
-		if (bits_[i].is_object() && pattern.count(bits_[i])) {
-			bits_.erase(bits_.begin() + i);
-			width_--;
-			if (other != nullptr) {
-				other->bits_.erase(other->bits_.begin() + i);
-				other->width_--;
+	// Keep the runs of bits that are not in the pattern.
+	DriverSpec kept, other_kept;
+	int pos = 0;
+	for (auto &chunk : chunks()) {
+		int run = 0;  // Start of the current run of kept bits, within chunk
+		for (int i = 0; i <= chunk.width; i++) {
+			if (i < chunk.width && !(chunk.is_object() && pattern.count(DriverBit(chunk, i))))
+				continue;
+			if (i > run) {
+				kept.append(chunk.extract(run, i - run));
+				if (other != nullptr)
+					other_kept.append(other->extract(pos + run, i - run));
 			}
+			run = i + 1;
 		}
+		pos += chunk.width;
 	}
 
+	*this = std::move(kept);
+	if (other != nullptr)
+		*other = std::move(other_kept);
+
 	check();
 }
 
@@ -755,33 +784,32 @@ void DriverSpec::remove2(const std::set<DriverBit> &pattern, DriverSpec *other)
 	else
 		cover("driverspec.remove");
 
-	unpack();
-
-	if (other != nullptr) {
+	if (other != nullptr)
 		log_assert(width_ == other->width_);
-		other->unpack();
-	}
 
-	for (int i = GetSize(bits_) - 1; i >= 0; i--) {
-		if (bits_[i].is_object() && pattern.count(bits_[i])) {
-			bits_.erase(bits_.begin() + i);
-			width_--;
-			if (other != nullptr) {
-				other->bits_.erase(other->bits_.begin() + i);
-				other->width_--;
+	// Keep the runs of bits that are not in the pattern.
+	DriverSpec kept, other_kept;
+	int pos = 0;
+	for (auto &chunk : chunks()) {
+		int run = 0;  // Start of the current run of kept bits, within chunk
+		for (int i = 0; i <= chunk.width; i++) {
+			if (i < chunk.width && !(chunk.is_object() && pattern.count(DriverBit(chunk, i))))
+				continue;
+			if (i > run) {
+				kept.append(chunk.extract(run, i - run));
+				if (other != nullptr)
+					other_kept.append(other->extract(pos + run, i - run));
 			}
+			run = i + 1;
 		}
+		pos += chunk.width;
 	}
 
-	check();
-}
-
+	*this = std::move(kept);
+	if (other != nullptr)
+		*other = std::move(other_kept);
 
-static bool extractable(const DriverBit& bit, const DriverChunk& chunk)
-{
-        return chunk.has_same_object(bit) &&
-                bit.offset >= chunk.offset &&
-                bit.offset < chunk.offset + chunk.width;
+	check();
 }
 
 
@@ -794,20 +822,25 @@ DriverSpec DriverSpec::extract(const DriverSpec &pattern, const DriverSpec *othe
 
 	log_assert(other == nullptr || width_ == other->width_);
 
+	// For each pattern chunk in turn, the parts of this that it covers.
 	DriverSpec ret;
-	std::vector<DriverBit> bits_match = to_driverbit_vector();
-
 	for (auto& pattern_chunk : pattern.chunks()) {
-		if (other) {
-			std::vector<DriverBit> bits_other = other->to_driverbit_vector();
-			for (int i = 0; i < width_; i++)
-                                // Doug: Simplified!
-                                if (extractable(bits_match[i], pattern_chunk))
-					ret.append(bits_other[i]);
-		} else {
-			for (int i = 0; i < width_; i++)
-                                if (extractable(bits_match[i], pattern_chunk))
-					ret.append(bits_match[i]);
+		if (!pattern_chunk.is_object())
+			continue;
+		int pos = 0;
+		for (auto &chunk : chunks()) {
+			if (chunk.is_object() && chunk.wire == pattern_chunk.wire &&
+			    chunk.cell == pattern_chunk.cell && chunk.port == pattern_chunk.port) {
+				int lo = std::max(chunk.offset, pattern_chunk.offset);
+				int hi = std::min(chunk.offset + chunk.width, pattern_chunk.offset + pattern_chunk.width);
+				if (lo < hi) {
+					if (other)
+						ret.append(other->extract(pos + lo - chunk.offset, hi - lo));
+					else
+						ret.append(chunk.extract(lo - chunk.offset, hi - lo));
+				}
+			}
+			pos += chunk.width;
 		}
 	}
 
@@ -824,18 +857,25 @@ DriverSpec DriverSpec::extract(const pool<DriverBit> &pattern, const DriverSpec
 
 	log_assert(other == nullptr || width_ == other->width_);
 
-	std::vector<DriverBit> bits_match = to_driverbit_vector();
+	// Extract the runs of bits that are in the pattern.
 	DriverSpec ret;
-
-	if (other) {
-		std::vector<DriverBit> bits_other = other->to_driverbit_vector();
-		for (int i = 0; i < width_; i++)
-			if (bits_match[i].is_object() && pattern.count(bits_match[i]))
-				ret.append(bits_other[i]);
-	} else {
-		for (int i = 0; i < width_; i++)
-			if (bits_match[i].is_object() && pattern.count(bits_match[i]))
-				ret.append(bits_match[i]);
+	int pos = 0;
+	for (auto &chunk : chunks()) {
+		if (chunk.is_object()) {
+			int run = 0;  // Start of the current run of matching bits, within chunk
+			for (int i = 0; i <= chunk.width; i++) {
+				if (i < chunk.width && pattern.count(DriverBit(chunk, i)))
+					continue;
+				if (i > run) {
+					if (other)
+						ret.append(other->extract(pos + run, i - run));
+					else
+						ret.append(chunk.extract(run, i - run));
+				}
+				run = i + 1;
+			}
+		}
+		pos += chunk.width;
 	}
 
 	ret.check();
@@ -846,15 +886,14 @@ void DriverSpec::replace(int offset, const DriverSpec &with)
 {
 	cover("driverspec.replace_pos");
 
-	unpack();
-	with.unpack();
-
 	log_assert(offset >= 0);
 	log_assert(with.width_ >= 0);
 	log_assert(offset+with.width_ <= width_);
 
-	for (int i = 0; i < with.width_; i++)
-		bits_.at(offset + i) = with.bits_.at(i);
+	DriverSpec ret = extract(0, offset);
+	ret.append(with);
+	ret.append(extract_end(offset + with.width_));
+	*this = std::move(ret);
 
 	check();
 }
@@ -865,7 +904,7 @@ void DriverSpec::remove_const()
 	{
 		cover("driverspec.remove_const.packed");
 
-		std::vector<DriverChunk> new_chunks;
+		ChunkVector new_chunks;
 		new_chunks.reserve(GetSize(chunks_));
 
 		width_ = 0;
@@ -884,6 +923,7 @@ void DriverSpec::remove_const()
 			}
 
 		chunks_.swap(new_chunks);
+		chunk_ends_.clear();
 	}
 	else
 	{
@@ -907,23 +947,73 @@ void DriverSpec::remove(int offset, int length)
 {
 	cover("driverspec.remove_pos");
 
-	unpack();
-
 	log_assert(offset >= 0);
 	log_assert(length >= 0);
 	log_assert(offset + length <= width_);
 
-	bits_.erase(bits_.begin() + offset, bits_.begin() + offset + length);
-	width_ = bits_.size();
+	DriverSpec ret = extract(0, offset);
+	ret.append(extract_end(offset + length));
+	*this = std::move(ret);
 
 	check();
 }
 
 DriverSpec DriverSpec::extract(int offset, int length) const
 {
-	unpack();
 	cover("driverspec.extract_pos");
-	return std::vector<DriverBit>(bits_.begin() + offset, bits_.begin() + offset + length);
+
+	log_assert(offset >= 0);
+	log_assert(length >= 0);
+	log_assert(offset + length <= width_);
+
+	pack();
+
+	DriverSpec ret;
+	int pos = 0;
+	for (auto &chunk : chunks_) {
+		if (pos >= offset + length)
+			break;
+		int lo = std::max(offset, pos);
+		int hi = std::min(offset + length, pos + chunk.width);
+		if (lo < hi)
+			ret.append(chunk.extract(lo - pos, hi - lo));
+		pos += chunk.width;
+	}
+	return ret;
+}
+
+// Up to this many chunks, the const operator[] just scans them.
+static const int MAX_SCANNED_CHUNKS = 8;
+
+DriverBit DriverSpec::operator[](int index) const
+{
+	log_assert(index >= 0 && index < width_);
+
+	if (!packed())
+		return bits_[index];
+
+	if (GetSize(chunks_) <= MAX_SCANNED_CHUNKS) {
+		for (auto &chunk : chunks_) {
+			if (index < chunk.width)
+				return DriverBit(chunk, index);
+			index -= chunk.width;
+		}
+		log_abort();
+	}
+
+	if (chunk_ends_.empty()) {
+		DriverSpec *that = (DriverSpec*)this;
+		that->chunk_ends_.reserve(chunks_.size());
+		int end = 0;
+		for (auto &chunk : chunks_) {
+			end += chunk.width;
+			that->chunk_ends_.push_back(end);
+		}
+	}
+
+	int n = std::upper_bound(chunk_ends_.begin(), chunk_ends_.end(), index) - chunk_ends_.begin();
+	log_assert(n < GetSize(chunks_));
+	return DriverBit(chunks_[n], n > 0 ? index - chunk_ends_[n-1] : index);
 }
 
 void DriverSpec::append(const DriverSpec &signal)
@@ -943,6 +1033,8 @@ void DriverSpec::append(const DriverSpec &signal)
 		signal.pack();
 	}
 
+	chunk_ends_.clear();
+
 	if (packed())
 		for (auto &other_c : signal.chunks_)
 		{
@@ -952,9 +1044,9 @@ void DriverSpec::append(const DriverSpec &signal)
 				auto &other_data = other_c.data;
 				this_data.insert(this_data.end(), other_data.begin(), other_data.end());
 				my_last_c.width += other_c.width;
-			} else if (my_last_c.wire == other_c.wire && my_last_c.offset + my_last_c.width == other_c.offset) {
-				my_last_c.width += other_c.width;
-			} else if (my_last_c.cell == other_c.cell && my_last_c.port == other_c.port &&
+			} else if (my_last_c.is_object() &&
+                                   my_last_c.wire == other_c.wire && my_last_c.cell == other_c.cell &&
+                                   my_last_c.port == other_c.port &&
                                    my_last_c.offset + my_last_c.width == other_c.offset) {
 				my_last_c.width += other_c.width;
 			} else
@@ -973,6 +1065,8 @@ void DriverSpec::append(const DriverBit &bit)
 	{
 		cover("driverspec.append_bit.packed");
 
+		chunk_ends_.clear();
+
 		if (chunks_.size() == 0) {
 			chunks_.push_back(bit);
                 } else {
@@ -1012,7 +1106,7 @@ void DriverSpec::extend_u0(int width, bool is_signed)
 		remove(width, width_ - width);
 
 	if (width_ < width) {
-		DriverBit padding = width_ > 0 ? (*this)[width_ - 1] : RTLIL::State::Sx;
+		DriverBit padding = width_ > 0 ? msb() : DriverBit(RTLIL::State::Sx);
 		if (!is_signed)
 			padding = RTLIL::State::S0;
 		while (width_ < width)
@@ -1087,13 +1181,13 @@ void DriverSpec::check(Module *mod) const
 
 		if (mod != nullptr) {
 			for (size_t i = 0; i < bits_.size(); i++) {
-				if (bits_[i].wire != nullptr) {
-					log_assert(bits_[i].wire->module == mod);
+				if (bits_[i].is_wire()) {
+					log_assert(bits_[i].wire()->module == mod);
                                 }
-				if (bits_[i].cell != nullptr) {
+				if (bits_[i].is_cell()) {
 					log_assert(!bits_[i].port.empty());
-                                        log_assert(bits_[i].cell->hasPort(bits_[i].port));
-					log_assert(bits_[i].cell->module == mod);
+                                        log_assert(bits_[i].cell()->hasPort(bits_[i].port));
+					log_assert(bits_[i].cell()->module == mod);
                                 }
                         }
 		}
@@ -1458,8 +1552,15 @@ std::vector<DriverBit> DriverSpec::to_driverbit_vector() const
 {
 	cover("driverspec.to_driverbit_vector");
 
-	unpack();
-	return bits_;
+	if (!packed())
+		return bits_;
+
+	std::vector<DriverBit> sigbits;
+	sigbits.reserve(width_);
+	for (auto &c : chunks_)
+		for (int i = 0; i < c.width; i++)
+			sigbits.emplace_back(c, i);
+	return sigbits;
 }
 
 std::map<DriverBit, DriverBit> DriverSpec::to_driverbit_map(const DriverSpec &other) const
@@ -1499,71 +1600,230 @@ dict<DriverBit, DriverBit> DriverSpec::to_driverbit_dict(const DriverSpec &other
 
 
 
-DriverFinder::DriverFinder(Yosys::RTLIL::Module *mod)
+DriverFinder::DriverFinder(Yosys::RTLIL::Module *mod) : module(nullptr)
 {
+  monitor.finder = this;
   build(mod);
 }
 
+DriverFinder::~DriverFinder()
+{
+  clear();
+}
+
 void DriverFinder::clear()
 {
   sigmap.clear();
-  canonical_sigbit_to_driving_cell_table.clear();
-  canonical_sigbit_to_driving_wire_table.clear();
+  wire_base.clear();
+  drivers.clear();
+  drivers.shrink_to_fit();
+  num_driving_bits = 0;
+  input_driver_index.clear();
+  input_driver_specs.clear();
   module = nullptr;
+  stale = false;
+
+  if (design) {
+    design->monitors.erase(&monitor);
+    design = nullptr;
+  }
 }
 
 
-void DriverFinder::build(RTLIL::Module *mod)
+void DriverFinder::ChangeMonitor::notify_module_del(RTLIL::Module *mod)
+{
+  if (mod == finder->module) {
+    finder->stale = true;
+    finder->module = nullptr;
+  }
+}
+
+void DriverFinder::ChangeMonitor::notify_connect(RTLIL::Cell *cell, const RTLIL::IdString&,
+                                                 const RTLIL::SigSpec&, const RTLIL::SigSpec&)
+{
+  if (cell->module == finder->module) finder->stale = true;
+}
+
+void DriverFinder::ChangeMonitor::notify_connect(RTLIL::Module *mod, const RTLIL::SigSig&)
+{
+  if (mod == finder->module) finder->stale = true;
+}
+
+void DriverFinder::ChangeMonitor::notify_connect(RTLIL::Module *mod,
+                                                 const std::vector<RTLIL::SigSig>&)
+{
+  if (mod == finder->module) finder->stale = true;
+}
+
+void DriverFinder::ChangeMonitor::notify_blackout(RTLIL::Module *mod)
+{
+  if (mod == finder->module) finder->stale = true;
+}
+
+
+// An output port connection of a cell, as collected by build().
+struct OutputConn {
+  RTLIL::Cell *cell;
+  const RTLIL::IdString *port;
+  const RTLIL::SigSpec *sig;
+};
+
+// A bit of an output connection, and the dense index of the canonical bit it
+// drives.  A constant is encoded as a negative index, by constant_index().
+struct OutputBit {
+  int canonical;
+  int conn;
+  int bit;
+};
+
+static inline int constant_index(RTLIL::State state) { return -1 - (int)state; }
+static inline RTLIL::State index_constant(int index) { return (RTLIL::State)(-1 - index); }
+
+// Don't submit a job for fewer connections than this.
+static const int MIN_CONNS_PER_JOB = 4096;
+
+
+// Find the canonical bits driven by conns[begin] to conns[end-1].  This runs
+// as a thread pool job, so it must not log, and it only reads the (already
+// packed) connections and the tables built so far.
+static void
+resolveOutputBits(const std::vector<OutputConn>& conns, int begin, int end,
+                  const std::unordered_map<RTLIL::Wire*, int>& wireBase,
+                  const std::vector<int>& canonical,
+                  std::vector<OutputBit>& result)
+{
+  for (int n = begin; n < end; n++) {
+    int idx = 0;
+    for (auto& chunk : conns[n].sig->chunks()) {
+      if (!chunk.wire) {
+        for (RTLIL::State state : chunk.data) {
+          result.push_back(OutputBit{constant_index(state), n, idx++});
+        }
+        continue;
+      }
+      int index = wireBase.at(chunk.wire) + chunk.offset;
+      for (int i = 0; i < chunk.width; i++) {
+        result.push_back(OutputBit{canonical[index + i], n, idx++});
+      }
+    }
+  }
+}
+
+
+void DriverFinder::build(RTLIL::Module *mod, ThreadPool *pool)
 {
   clear();
 
   module = mod;
 
+  // Watch for changes to the module, so that is_current() can tell whether
+  // the tables need to be re-built.
+  design = module->design;
+  if (design) {
+    design->monitors.insert(&monitor);
+  }
+
   sigmap.set(module);
 
-  // Process every bit of every cell output
-  
+  // Give every wire bit its dense index.
+  int numBits = 0;
+  wire_base.reserve(GetSize(module->wires_));
+  for (auto wire : module->wires()) {
+    wire_base[wire] = numBits;
+    numBits += wire->width;
+  }
+  drivers.assign(numBits, DriverBit(RTLIL::State::Sm));
+
+  // The dense index of each bit's canonical bit, or its constant value.
+  // This is all that the threads below need of the sigmap.
+  std::vector<int> canonical(numBits);
+  for (auto wire : module->wires()) {
+    RTLIL::SigSpec canonical_sig = sigmap(wire);
+    int index = wire_base.at(wire);
+    for (auto& chunk : canonical_sig.chunks()) {
+      if (!chunk.wire) {
+        for (RTLIL::State state : chunk.data) {
+          canonical[index++] = constant_index(state);
+        }
+        continue;
+      }
+      int canonicalIndex = bit_index(RTLIL::SigBit(chunk.wire, chunk.offset));
+      for (int i = 0; i < chunk.width; i++) {
+        canonical[index++] = canonicalIndex + i;
+      }
+    }
+  }
+
+  // First record the driver of each canonical bit.
+
+  // Process every bit of every cell output.  Cell::output() works with
+  // IdStrings, whose reference counts are not thread-safe, so the output
+  // connections are collected (and packed) here.  For the same kind of
+  // reason, the flattening of the sigmap above is not split up either:
+  // SigMap lookups compress the paths of its union-find, so they write.  Then contiguous ranges of
+  // them are resolved in parallel, and the results are applied in cell order,
+  // so that multi-driven bits are reported just as with one thread.
+
+  std::vector<OutputConn> conns;
   for (auto cell : module->cells()) {
     for (auto& conn : cell->connections()) {
       // conn.first is the signal IdString, conn.second is its SigSpec
       if (cell->output(conn.first)) {
-        RTLIL::SigSpec canonical_sig = sigmap(conn.second);
-        //log_debug("\nCell %s port %s -> ", cell->name.c_str(),  conn.first.c_str());
-        //my_log_debug_sigspec(conn.second);
-        //log_debug("\ncanonical: ");
-        //my_log_debug_sigspec(canonical_sig);
-        int idx = -1;
-        for (auto& bit : canonical_sig.to_sigbit_vector()) {
-          ++idx;
-          // sigmap(conn.second) is the canonical SigSpec.
-          // bit is a canonical SigBit
-          //log_debug("  ");
-          //my_log_debug_sigbit(bit);
-
-          // A cell can't drive a constant!
-          if (!bit.is_wire()) {
-            log_error("Cell %s output %s bit %d is driving a constant %d\n",
-                        cell->name.c_str(), conn.first.c_str(), idx, bit.data);
-          }
-
-          if (canonical_sigbit_to_driving_wire_table.count(bit) != 0) { 
-            log_warning("Multi-driven bit!:\n");
-            my_log_sigbit(bit);
-            log("Driven by %s %d and cell output %s %d\n",
-                      canonical_sigbit_to_driving_wire_table[bit].wire->name.c_str(),
-                      canonical_sigbit_to_driving_wire_table[bit].bit,
-                      conn.first.c_str(), idx);
-            log_flush();
-          }
-
-          log_assert(canonical_sigbit_to_driving_cell_table.count(bit) == 0);
-          canonical_sigbit_to_driving_cell_table.emplace(bit, CellPortBit{cell, conn.first, idx});
-        }
+        conn.second.chunks();  // Packs it, if it is not already
+        conns.push_back(OutputConn{cell, &conn.first, &conn.second});
+      }
+    }
+  }
+
+  int numParts = pool ? std::max(1, std::min(pool->size(), GetSize(conns) / MIN_CONNS_PER_JOB)) : 1;
+  std::vector<std::vector<OutputBit>> parts(numParts);
+  if (numParts == 1) {
+    resolveOutputBits(conns, 0, GetSize(conns), wire_base, canonical, parts[0]);
+  } else {
+    std::vector<std::future<void>> jobs;
+    for (int p = 0; p < numParts; p++) {
+      int begin = (int)((int64_t)GetSize(conns) * p / numParts);
+      int end = (int)((int64_t)GetSize(conns) * (p+1) / numParts);
+      std::vector<OutputBit>& part = parts[p];
+      jobs.push_back(pool->submit([&conns, begin, end, this, &canonical, &part] {
+        resolveOutputBits(conns, begin, end, wire_base, canonical, part);
+      }));
+    }
+    for (std::future<void>& job : jobs) {
+      job.get();
+    }
+  }
+
+  for (std::vector<OutputBit>& part : parts) {
+    for (const OutputBit& ob : part) {
+      const OutputConn& conn = conns[ob.conn];
+
+      // A cell can't drive a constant!
+      if (ob.canonical < 0) {
+        log_error("Cell %s output %s bit %d is driving a constant %d\n",
+                    conn.cell->name.c_str(), conn.port->c_str(), ob.bit,
+                    index_constant(ob.canonical));
       }
+
+      DriverBit& driver = drivers[ob.canonical];
+      if (driver.is_wire()) { 
+        log_warning("Multi-driven bit!:\n");
+        my_log_sigbit(sigmap((*conn.sig)[ob.bit]));
+        log("Driven by %s %d and cell output %s %d\n",
+                  driver.wire()->name.c_str(), driver.offset,
+                  conn.port->c_str(), ob.bit);
+        log_flush();
+      }
+
+      log_assert(!driver.is_cell());
+      driver = DriverBit(conn.cell, *conn.port, ob.bit);
+      ++num_driving_bits;
     }
+    std::vector<OutputBit>().swap(part);  // Free it
   }
 
-  // Process every bit of every top-level input port
+  // Process every bit of every top-level input port.  These take precedence
+  // over cells driving the same bit.
   
   for (auto wire : module->wires()) {
     if (wire->port_input) {
@@ -1586,45 +1846,48 @@ void DriverFinder::build(RTLIL::Module *mod)
           continue;
         }
 
-        if (canonical_sigbit_to_driving_wire_table.count(bit) != 0) { 
+        DriverBit& driver = drivers[bit_index(bit)];
+        if (driver.is_wire()) { 
           log("Multi-driven bit!:\n");
           my_log_sigbit(bit);
           log("Driven by %s %d and %s %d\n",
-                    canonical_sigbit_to_driving_wire_table[bit].wire->name.c_str(),
-                    canonical_sigbit_to_driving_wire_table[bit].bit,
+                    driver.wire()->name.c_str(), driver.offset,
                     wire->name.c_str(), idx);
           log_flush();
         }
 
-        log_assert(canonical_sigbit_to_driving_wire_table.count(bit) == 0);  // Multi-driven
-        canonical_sigbit_to_driving_wire_table.emplace(bit, WireBit{wire, idx});
+        log_assert(!driver.is_wire());  // Multi-driven
+        driver = DriverBit(wire, idx);
+        ++num_driving_bits;
       }
     }
   }
-}
-
 
-
-DriverFinder::WireBit*
-DriverFinder::getDrivingWire(const RTLIL::SigBit& canonicalSigbit)
-{
-  auto iter = canonical_sigbit_to_driving_wire_table.find(canonicalSigbit);
-  if (iter != canonical_sigbit_to_driving_wire_table.end()) {
-    return &(iter->second);
+  // Then give every other bit the driver of its canonical bit (or its
+  // constant value), so that lookups need no sigmap.  Only canonical bits
+  // were set above, and they are not changed here.
+  for (int index = 0; index < numBits; index++) {
+    int canonicalIndex = canonical[index];
+    if (canonicalIndex < 0) {
+      drivers[index] = DriverBit(index_constant(canonicalIndex));
+    } else if (canonicalIndex != index) {
+      drivers[index] = drivers[canonicalIndex];
+    }
   }
-  return nullptr;  // Not driven by a wire
+
+  sigmap.clear();  // No longer needed
 }
 
 
 
-DriverFinder::CellPortBit*
-DriverFinder::getDrivingCell(const RTLIL::SigBit& canonicalSigbit)
+const DriverBit*
+DriverFinder::getDriver(const RTLIL::SigBit& sigbit) const
 {
-  auto iter = canonical_sigbit_to_driving_cell_table.find(canonicalSigbit);
-  if (iter != canonical_sigbit_to_driving_cell_table.end()) {
-    return &(iter->second);
+  if (!sigbit.is_wire()) {
+    return nullptr;
   }
-  return nullptr;  // Not driven by a cell
+  const DriverBit& driver = drivers[bit_index(sigbit)];
+  return (driver.is_object()) ? &driver : nullptr;
 }
 
 
@@ -1642,50 +1905,59 @@ DriverFinder::buildDriverOf(RTLIL::Wire *wire, DriverSpec& driver)
 
 // Get a description of what drives the given SigSpec (which could be the
 // connection of a cell input port, or a wire representing a module output
-// port).
+// port).  Each wire bit's driver is read from drivers, a slice at a time.
 
 void
 DriverFinder::buildDriverOf(const RTLIL::SigSpec& sigspec, DriverSpec& driver)
 {
   driver = DriverSpec();  // Clear
 
-  for (auto& bit : sigspec.to_sigbit_vector()) {
-    RTLIL::SigBit canonicalBit = sigmap(bit);
+  for (auto& chunk : sigspec.chunks()) {
+    if (!chunk.wire) {
+      // A constant data value
+      driver.append(RTLIL::Const(chunk.data));
+      continue;
+    }
 
-    DriverBit dBit;
+    auto it = wire_base.find(chunk.wire);
+    log_assert(it != wire_base.end());
+    const DriverBit *dBit = &drivers[it->second + chunk.offset];
 
-    if (!canonicalBit.is_wire()) {
-      // A constant data value
-      dBit = DriverBit(canonicalBit.data);
-    } else {
-      // See if the driver is a module input port (represented by a wire)
-      WireBit *wb = getDrivingWire(canonicalBit);
-      if (wb) {
-        log_assert(wb->wire->port_input);
-        dBit = DriverBit(wb->wire, wb->bit);
+    for (int i = 0; i < chunk.width; i++, dBit++) {
+      if (is_undriven(*dBit)) {
+        // No connection!
+        log_assert(false);
+        driver.append(RTLIL::State::Sx);
       } else {
-        // See if the driver is a cell output port (represented by a cell/portname)
-        CellPortBit *cpb = getDrivingCell(canonicalBit);
-        if (cpb) {
-          dBit = DriverBit(cpb->cell, cpb->port, cpb->bit);
-        } else {
-          // No connection!
-          log_assert(false);
-          dBit = DriverBit(RTLIL::State::Sx);
-        }
+        driver.append(*dBit);
       }
     }
+  }
+
+}
+
+
+const DriverSpec&
+DriverFinder::driverOf(RTLIL::Cell *cell, RTLIL::IdString port)
+{
+  log_assert(cell->module == module);
 
-    driver.append(dBit);
+  auto key = std::make_pair(cell, port);
+  auto it = input_driver_index.find(key);
+  if (it != input_driver_index.end()) {
+    return input_driver_specs[it->second];
   }
 
+  input_driver_index.emplace(key, GetSize(input_driver_specs));
+  input_driver_specs.emplace_back();
+  buildDriverOf(cell->getPort(port), input_driver_specs.back());
+  return input_driver_specs.back();
 }
 
 
 size_t DriverFinder::size() const
 {
-  return canonical_sigbit_to_driving_cell_table.size() +
-         canonical_sigbit_to_driving_wire_table.size();
+  return num_driving_bits;
 }
 
 
@@ -1,9 +1,16 @@
 #ifndef DRIVER_TOOLS_H
 #define DRIVER_TOOLS_H
 
+#include "llvm/ADT/SmallVector.h"
+
+#include <deque>
+#include <unordered_map>
+
 #include "kernel/yosys.h"
 #include "kernel/sigtools.h"
 
+class ThreadPool;
+
 // An enhanced version of Yosys::RTLIL::SigSpec.
 // It describes collections of constants, cell port bits, and wire bits
 // (which represent module input ports): the things that can actually
@@ -55,14 +62,19 @@ struct DriverChunk
 
 
 
+// A DriverSpec is unpacked into one of these per bit, so it is kept to
+// 16 bytes: the wire or cell is a single tagged pointer (the low bit is set
+// for a cell), next to the port name and the offset or constant value.
 struct DriverBit
 {
-	Yosys::RTLIL::Wire *wire; // Only one of wire and cell will be non-null
-	Yosys::RTLIL::Cell *cell;
-        Yosys::RTLIL::IdString port;  // Only valid if cell is set.
+private:
+	uintptr_t object_;  // Null for a constant
+
+public:
+        Yosys::RTLIL::IdString port;  // Only valid for a cell.
 	union {
-		Yosys::RTLIL::State data; // used if wire and cell == nullptr
-		int offset;        // used if wire or cell != nullptr
+		Yosys::RTLIL::State data; // used for a constant
+		int offset;        // used for a wire or cell
 	};
 
 	DriverBit();
@@ -78,17 +90,37 @@ struct DriverBit
 	DriverBit(const DriverBit &driverbit) = default;
 	DriverBit &operator =(const DriverBit &other) = default;
 
-	inline bool is_wire() const { return wire != nullptr; }
-	inline bool is_cell() const { return cell != nullptr; }
-	inline bool is_object() const { return cell != nullptr || wire != nullptr; }
+	inline Yosys::RTLIL::Wire *wire() const {
+		return (object_ & 1) ? nullptr : reinterpret_cast<Yosys::RTLIL::Wire*>(object_);
+	}
+	inline Yosys::RTLIL::Cell *cell() const {
+		return (object_ & 1) ? reinterpret_cast<Yosys::RTLIL::Cell*>(object_ & ~uintptr_t(1)) : nullptr;
+	}
+
+	inline bool is_wire() const { return object_ != 0 && !(object_ & 1); }
+	inline bool is_cell() const { return (object_ & 1) != 0; }
+	inline bool is_object() const { return object_ != 0; }
 	inline bool is_data() const { return !is_object(); }
 
 	bool operator <(const DriverBit &other) const;
 	bool operator ==(const DriverBit &other) const;
 	bool operator !=(const DriverBit &other) const;
 	unsigned int hash() const;
+
+private:
+	inline void set_wire(Yosys::RTLIL::Wire *wire) {
+		object_ = reinterpret_cast<uintptr_t>(wire);
+	}
+	inline void set_cell(Yosys::RTLIL::Cell *cell) {
+		object_ = cell ? (reinterpret_cast<uintptr_t>(cell) | 1) : 0;
+	}
+	inline void set_object(Yosys::RTLIL::Wire *wire, Yosys::RTLIL::Cell *cell) {
+		if (cell) set_cell(cell); else set_wire(wire);
+	}
 };
 
+static_assert(sizeof(void*) != 8 || sizeof(DriverBit) == 16, "DriverBit should be 16 bytes");
+
 struct DriverSpecIterator : public std::iterator<std::input_iterator_tag, DriverSpec>
 {
 	DriverSpec *sig_p;
@@ -104,21 +136,34 @@ struct DriverSpecConstIterator : public std::iterator<std::input_iterator_tag, D
 {
 	const DriverSpec *sig_p;
 	int index;
+	// If the spec was packed at begin(): the chunk holding bit index, and
+	// the bit's offset in it, so a step does not search the chunks again.
+	// Otherwise chunk is -1.
+	int chunk;
+	int offset;
 
-	inline const DriverBit &operator*() const;
+	inline DriverBit operator*() const;
 	inline bool operator!=(const DriverSpecConstIterator &other) const { return index != other.index; }
 	inline bool operator==(const DriverSpecIterator &other) const { return index == other.index; }
-	inline void operator++() { index++; }
+	inline void operator++();
 };
 
 
 struct DriverSpec
 {
+public:
+	// Most specs are a single chunk, which is stored inline.
+	typedef llvm::SmallVector<DriverChunk, 1> ChunkVector;
+
 private:
 	int width_;
 	unsigned long hash_;
-	std::vector<DriverChunk> chunks_; // LSB at index 0
+	ChunkVector chunks_; // LSB at index 0
 	std::vector<DriverBit> bits_; // LSB at index 0
+	// For a packed spec with many chunks, the end offset of each chunk, so
+	// the const operator[] can binary search them.  Built on first use, and
+	// cleared whenever chunks_ changes.
+	std::vector<int> chunk_ends_;
 
 	void pack() const;
 	void unpack() const;
@@ -136,6 +181,7 @@ private:
 	// Only used by Module::remove(const pool<Wire*> &wires)
 	// but cannot be more specific as it isn't yet declared
 	friend struct Yosys::RTLIL::Module;
+	friend struct DriverSpecConstIterator;
 
 public:
 	DriverSpec();
@@ -164,6 +210,7 @@ public:
 		hash_ = other.hash_;
 		chunks_ = std::move(other.chunks_);
 		bits_ = std::move(other.bits_);
+		chunk_ends_ = std::move(other.chunk_ends_);
 	}
 
 	const DriverSpec &operator=(DriverSpec &&other) {
@@ -171,6 +218,7 @@ public:
 		hash_ = other.hash_;
 		chunks_ = std::move(other.chunks_);
 		bits_ = std::move(other.bits_);
+		chunk_ends_ = std::move(other.chunk_ends_);
 		return *this;
 	}
 
@@ -179,20 +227,29 @@ public:
 		return hash_;
 	}
 
-	inline const std::vector<DriverChunk> &chunks() const { pack(); return chunks_; }
+	inline const ChunkVector &chunks() const { pack(); return chunks_; }
 	inline const std::vector<DriverBit> &bits() const { inline_unpack(); return bits_; }
 
 	inline int size() const { return width_; }
 	inline bool empty() const { return width_ == 0; }
 
 	inline DriverBit &operator[](int index) { inline_unpack(); return bits_.at(index); }
-	inline const DriverBit &operator[](int index) const { inline_unpack(); return bits_.at(index); }
+	// A packed spec is not unpacked for this.  The chunk holding the bit is
+	// found by a binary search of chunk_ends_, or a scan of a few chunks.
+	DriverBit operator[](int index) const;
+
+	inline DriverBit lsb() const { log_assert(width_); return (*this)[0]; }
+	inline DriverBit msb() const { log_assert(width_); return (*this)[width_ - 1]; }
 
 	inline DriverSpecIterator begin() { DriverSpecIterator it; it.sig_p = this; it.index = 0; return it; }
 	inline DriverSpecIterator end() { DriverSpecIterator it; it.sig_p = this; it.index = width_; return it; }
 
-	inline DriverSpecConstIterator begin() const { DriverSpecConstIterator it; it.sig_p = this; it.index = 0; return it; }
-	inline DriverSpecConstIterator end() const { DriverSpecConstIterator it; it.sig_p = this; it.index = width_; return it; }
+	inline DriverSpecConstIterator begin() const {
+		DriverSpecConstIterator it; it.sig_p = this; it.index = 0; it.chunk = packed() ? 0 : -1; it.offset = 0; return it;
+	}
+	inline DriverSpecConstIterator end() const {
+		DriverSpecConstIterator it; it.sig_p = this; it.index = width_; it.chunk = -1; it.offset = 0; return it;
+	}
 
 	void sort();
 	void sort_and_unify();
@@ -278,7 +335,7 @@ public:
 	std::map<DriverBit, DriverBit> to_driverbit_map(const DriverSpec &other) const;
         Yosys::dict<DriverBit, DriverBit> to_driverbit_dict(const DriverSpec &other) const;
 
-	operator std::vector<DriverChunk>() const { return chunks(); }
+	operator std::vector<DriverChunk>() const { return std::vector<DriverChunk>(chunks().begin(), chunks().end()); }
 	operator std::vector<DriverBit>() const { return bits(); }
 	const DriverBit &at(int offset, const DriverBit &defval) { return offset < width_ ? (*this)[offset] : defval; }
 
@@ -292,34 +349,46 @@ public:
 };
 
 
-inline DriverBit::DriverBit() : wire(nullptr), cell(nullptr), data(Yosys::RTLIL::State::S0) { }
-inline DriverBit::DriverBit(Yosys::RTLIL::State bit) : wire(nullptr), cell(nullptr), data(bit) { }
-inline DriverBit::DriverBit(bool bit) : wire(nullptr), cell(nullptr), data(bit ? Yosys::RTLIL::State::S1 : Yosys::RTLIL::State::S0) { }
+inline DriverBit::DriverBit() : object_(0), offset(0) { data = Yosys::RTLIL::State::S0; }
+inline DriverBit::DriverBit(Yosys::RTLIL::State bit) : object_(0), offset(0) { data = bit; }
+inline DriverBit::DriverBit(bool bit) : object_(0), offset(0) { data = bit ? Yosys::RTLIL::State::S1 : Yosys::RTLIL::State::S0; }
 
-inline DriverBit::DriverBit(Yosys::RTLIL::Wire *wire) : wire(wire), cell(nullptr), offset(0) { log_assert(wire && wire->width == 1); }
-inline DriverBit::DriverBit(Yosys::RTLIL::Wire *wire, int offset) : wire(wire), cell(nullptr), offset(offset) { log_assert(wire != nullptr); }
+inline DriverBit::DriverBit(Yosys::RTLIL::Wire *wire) : offset(0) { log_assert(wire && wire->width == 1); set_wire(wire); }
+inline DriverBit::DriverBit(Yosys::RTLIL::Wire *wire, int offset) : offset(offset) { log_assert(wire != nullptr); set_wire(wire); }
 
+// Constants come first, then cell bits, then wire bits.  Objects are
+// ordered by name, so that the order does not depend on addresses.
 inline bool DriverBit::operator<(const DriverBit &other) const {
-	if (wire == other.wire)
-		return wire ? (offset < other.offset) : (data < other.data);
-	if (wire != nullptr && other.wire != nullptr)
-		return wire->name < other.wire->name;
-	return (wire != nullptr) < (other.wire != nullptr);
+	if (object_ == other.object_) {
+		if (!object_)
+			return data < other.data;
+		if (port != other.port)
+			return port < other.port;
+		return offset < other.offset;
+	}
+	int rank = is_wire() ? 2 : is_cell() ? 1 : 0;
+	int other_rank = other.is_wire() ? 2 : other.is_cell() ? 1 : 0;
+	if (rank != other_rank)
+		return rank < other_rank;
+	if (rank == 2)
+		return wire()->name < other.wire()->name;
+	return cell()->name < other.cell()->name;
 }
 
 inline bool DriverBit::operator==(const DriverBit &other) const {
-	return (wire == other.wire) && (wire ? (offset == other.offset) : (data == other.data));
+	return (object_ == other.object_) &&
+	       (object_ ? (offset == other.offset && port == other.port) : (data == other.data));
 }
 
 inline bool DriverBit::operator!=(const DriverBit &other) const {
-	return (wire != other.wire) || (wire ? (offset != other.offset) : (data != other.data));
+	return !(*this == other);
 }
 
 inline unsigned int DriverBit::hash() const {
-	if (wire)
-		return Yosys::hashlib::mkhash_add(wire->name.hash(), offset);
-        else if (cell)
-		return Yosys::hashlib::mkhash_add(cell->name.hash(), Yosys::hashlib::mkhash_add(port.hash(), offset));
+	if (is_wire())
+		return Yosys::hashlib::mkhash_add(wire()->name.hash(), offset);
+        else if (is_cell())
+		return Yosys::hashlib::mkhash_add(cell()->name.hash(), Yosys::hashlib::mkhash_add(port.hash(), offset));
 	return data;
 }
 
@@ -327,10 +396,26 @@ inline DriverBit &DriverSpecIterator::operator*() const {
 	return (*sig_p)[index];
 }
 
-inline const DriverBit &DriverSpecConstIterator::operator*() const {
+inline DriverBit DriverSpecConstIterator::operator*() const {
+	if (chunk >= 0 && sig_p->packed())
+		return DriverBit(sig_p->chunks_[chunk], offset);
 	return (*sig_p)[index];
 }
 
+inline void DriverSpecConstIterator::operator++() {
+	index++;
+	if (chunk < 0)
+		return;
+	if (!sig_p->packed()) {
+		chunk = -1;  // Unpacked since begin(), so fall back on operator[]
+		return;
+	}
+	if (++offset == sig_p->chunks_[chunk].width) {
+		chunk++;
+		offset = 0;
+	}
+}
+
 inline DriverBit::DriverBit(const DriverSpec &sig) {
 	log_assert(sig.size() == 1 && sig.chunks().size() == 1);
 	*this = DriverBit(sig.chunks().front());
@@ -341,29 +426,31 @@ class DriverFinder {
 
 public:
 
-  // Struct to specify a particular bit of a particular port of a particular cell.
-  // BTW, all the built-in cells have only one output, named "\Y"
-  // Mostly for internal use
-  struct CellPortBit {
-    Yosys::RTLIL::Cell *cell;
-    Yosys::RTLIL::IdString port;
-    int bit;
-  };
-
-  // Struct to specify a particular bit of a particular wire
-  // Mostly for internal use
-  struct WireBit {
-    Yosys::RTLIL::Wire *wire;
-    int bit;
-  };
-
-  DriverFinder() : module(nullptr) {};
+  DriverFinder() : module(nullptr) { monitor.finder = this; };
 
   DriverFinder(Yosys::RTLIL::Module *mod);
-
-  void build(Yosys::RTLIL::Module *mod);
+  ~DriverFinder();
+
+  // The finder registers itself as a monitor of the module's design.
+  DriverFinder(const DriverFinder&) = delete;
+  DriverFinder& operator=(const DriverFinder&) = delete;
+
+  // With a thread pool, the cell outputs of a big module are resolved to the
+  // bits they drive by jobs in the pool, while this thread waits.  So this
+  // must not be called from a job of the same pool.  Only that lookup phase
+  // is parallel: building the sigmap, flattening it and collecting the cell
+  // outputs stay on this thread (see build()).
+  void build(Yosys::RTLIL::Module *mod, ThreadPool *pool = nullptr);
   void clear();
 
+  // Return true if the tables were built for the given module, and the
+  // module's connections have not changed since.  If so, there is no need to
+  // re-build them.
+  bool is_current(Yosys::RTLIL::Module *mod) const
+  {
+    return module == mod && mod != nullptr && !stale;
+  }
+
   size_t size() const;  // Total number of driving cell and wire bits
 
   // The most important functions
@@ -375,22 +462,59 @@ public:
   // Get a description of what drives the given SigSpec. driver gets filled in.
   void buildDriverOf(const Yosys::RTLIL::SigSpec& sigspec, DriverSpec& driver);
 
+  // Get a description of what drives the given input port of the given
+  // cell.  It is built on the first call for the port and kept until the
+  // tables are cleared, so the reference stays valid until then.
+  const DriverSpec& driverOf(Yosys::RTLIL::Cell *cell, Yosys::RTLIL::IdString port);
+
 
-  // Mostly for internal use
-  WireBit *getDrivingWire(const Yosys::RTLIL::SigBit& canonicalSigbit);
-  CellPortBit *getDrivingCell(const Yosys::RTLIL::SigBit& canonicalSigbit);
+  // Mostly for internal use.  Returns null for a constant or undriven bit.
+  const DriverBit *getDriver(const Yosys::RTLIL::SigBit& sigbit) const;
 
 private:
+  // Marks the finder as stale when its module's connections change, or when
+  // the module is deleted.
+  struct ChangeMonitor : public Yosys::RTLIL::Monitor {
+    DriverFinder *finder = nullptr;
+
+    void notify_module_del(Yosys::RTLIL::Module *mod) override;
+    void notify_connect(Yosys::RTLIL::Cell *cell, const Yosys::RTLIL::IdString&,
+                        const Yosys::RTLIL::SigSpec&, const Yosys::RTLIL::SigSpec&) override;
+    void notify_connect(Yosys::RTLIL::Module *mod, const Yosys::RTLIL::SigSig&) override;
+    void notify_connect(Yosys::RTLIL::Module *mod,
+                        const std::vector<Yosys::RTLIL::SigSig>&) override;
+    void notify_blackout(Yosys::RTLIL::Module *mod) override;
+  };
+
   Yosys::RTLIL::Module *module;
+  Yosys::RTLIL::Design *design = nullptr;  // Where the monitor is registered
+  ChangeMonitor monitor;
+  bool stale = false;
 
-  // Maps:
-  // 1:  A SigSpec to its canonical SigSpec
-  // 2: A SigBit to its canonical SigBit
-  // 3: A Wire to its canonical SigSpec
+  // Maps each SigBit to its canonical SigBit.  Only used by build(), which
+  // resolves every wire bit through it into drivers.
   Yosys::SigMap sigmap;
 
-  Yosys::dict<Yosys::RTLIL::SigBit, CellPortBit> canonical_sigbit_to_driving_cell_table;
-  Yosys::dict<Yosys::RTLIL::SigBit, WireBit> canonical_sigbit_to_driving_wire_table;
+  // Each wire bit of the module has a dense index: its wire's base plus
+  // its offset.  The sigmap is only needed while building.  Not a dict,
+  // whose const lookups can rehash, because build() reads it from several
+  // threads.
+  std::unordered_map<Yosys::RTLIL::Wire*, int> wire_base;
+
+  // What drives each wire bit, by dense index.  Bits without a driver
+  // hold an Sm constant, which no real driver can be.
+  std::vector<DriverBit> drivers;
+  size_t num_driving_bits = 0;
+
+  // The memo for driverOf(), indexing input_driver_specs, whose elements
+  // never move.
+  Yosys::dict<std::pair<Yosys::RTLIL::Cell*, Yosys::RTLIL::IdString>, int> input_driver_index;
+  std::deque<DriverSpec> input_driver_specs;
+
+  int bit_index(const Yosys::RTLIL::SigBit& bit) const { return wire_base.at(bit.wire) + bit.offset; }
+  static bool is_undriven(const DriverBit& driver) {
+    return driver.is_data() && driver.data == Yosys::RTLIL::State::Sm;
+  }
 
 };
 
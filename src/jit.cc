@@ -0,0 +1,557 @@
+#include "jit.h"
+
+// LLVM headers
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/TargetSelect.h"
+
+// Without this, yosys.h gets confused by the above LLVM headers.
+#include "llvm/IR/PassManager.h"
+
+// Yosys headers
+#include "kernel/yosys.h"
+#include "kernel/consteval.h"
+
+#include <map>
+#include <random>
+
+
+// Unfortunately including func_extract/src/util.h triggers the nasty "#define ID" issue.
+namespace funcExtract {
+  uint32_t get_padded_width(uint32_t width);
+}
+
+
+USING_YOSYS_NAMESPACE
+
+
+// A JIT-compiled update function.  It is called through a wrapper that
+// takes a single byte buffer holding all the args followed by the result,
+// so that func_extract_eval can call any function the same way.
+struct JitFunction {
+  JitFunctionInfo info;
+  std::vector<int> argOffsets;  // Into the buffer
+  int resultOffset = 0;
+  int bufferSize = 0;
+  void (*entry)(uint8_t *buffer) = nullptr;
+};
+
+static std::unique_ptr<llvm::orc::LLJIT> theJit;
+static std::map<std::string, JitFunction> jitFunctions;
+static int jitDylibCount = 0;
+
+
+static llvm::orc::LLJIT *
+getJit()
+{
+  if (!theJit) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    auto jit = llvm::orc::LLJITBuilder().create();
+    if (!jit) {
+      log_error("Cannot create the LLVM JIT: %s\n", llvm::toString(jit.takeError()).c_str());
+    }
+    theJit = std::move(*jit);
+  }
+  return theJit.get();
+}
+
+
+// The size of each element of the value in the buffer.  ASV array elements
+// are padded as they are in the function's arrays, since the function
+// accesses them in place.  Other values are just rounded up to whole bytes.
+static int
+elementBytes(const JitValueInfo& value)
+{
+  if (value.isArray) {
+    return funcExtract::get_padded_width(value.width) / 8;
+  }
+  return (value.width + 7) / 8;
+}
+
+
+static void
+layoutBuffer(JitFunction& jf)
+{
+  int offset = 0;
+  auto allocate = [&offset](const JitValueInfo& value) {
+    int start = offset;
+    offset += value.numElems * elementBytes(value);
+    offset = (offset + 7) & ~7;
+    return start;
+  };
+
+  for (const JitValueInfo& arg : jf.info.args) {
+    jf.argOffsets.push_back(allocate(arg));
+  }
+  jf.resultOffset = allocate(jf.info.result);
+  jf.bufferSize = offset;
+}
+
+
+// The buffer is not aligned for the LLVM types, so every element is
+// loaded or stored on its own with byte alignment.
+
+static llvm::Value *
+generateBufferLoad(llvm::IRBuilder<>& b, llvm::Value *slot,
+                   const JitValueInfo& value, llvm::Type *ty)
+{
+  llvm::IntegerType *elemTy = b.getIntNTy(value.width);
+  llvm::Type *elemPtrTy = llvm::PointerType::getUnqual(elemTy);
+
+  if (!ty->isVectorTy()) {
+    return b.CreateAlignedLoad(elemTy, b.CreateBitCast(slot, elemPtrTy), llvm::Align(1));
+  }
+
+  llvm::Value *vec = llvm::UndefValue::get(ty);
+  for (int i = 0; i < value.numElems; ++i) {
+    llvm::Value *p = b.CreateConstInBoundsGEP1_32(b.getInt8Ty(), slot, i * elementBytes(value));
+    llvm::Value *elem = b.CreateAlignedLoad(elemTy, b.CreateBitCast(p, elemPtrTy), llvm::Align(1));
+    vec = b.CreateInsertElement(vec, elem, i);
+  }
+  return vec;
+}
+
+
+static void
+generateBufferStore(llvm::IRBuilder<>& b, llvm::Value *slot,
+                    const JitValueInfo& value, llvm::Value *val)
+{
+  llvm::IntegerType *elemTy = b.getIntNTy(value.width);
+  llvm::Type *elemPtrTy = llvm::PointerType::getUnqual(elemTy);
+
+  if (!val->getType()->isVectorTy()) {
+    b.CreateAlignedStore(val, b.CreateBitCast(slot, elemPtrTy), llvm::Align(1));
+    return;
+  }
+
+  for (int i = 0; i < value.numElems; ++i) {
+    llvm::Value *p = b.CreateConstInBoundsGEP1_32(b.getInt8Ty(), slot, i * elementBytes(value));
+    b.CreateAlignedStore(b.CreateExtractElement(val, i), b.CreateBitCast(p, elemPtrTy),
+                         llvm::Align(1));
+  }
+}
+
+
+// Add the buffer-based wrapper of func to mod, and return its name.
+static std::string
+generateWrapper(llvm::Module *mod, llvm::Function *func, const JitFunction& jf)
+{
+  llvm::LLVMContext& c = mod->getContext();
+  llvm::IRBuilder<> b(c);
+
+  llvm::FunctionType *wrapperTy =
+    llvm::FunctionType::get(b.getVoidTy(), {b.getInt8PtrTy()}, false);
+  llvm::Function *wrapper =
+    llvm::Function::Create(wrapperTy, llvm::Function::ExternalLinkage,
+                           func->getName() + "_;_jit", mod);
+  b.SetInsertPoint(llvm::BasicBlock::Create(c, "bb_;_jit", wrapper));
+  llvm::Value *buffer = wrapper->getArg(0);
+
+  std::vector<llvm::Value*> callArgs;
+  for (size_t n = 0; n < jf.info.args.size(); ++n) {
+    const JitValueInfo& arg = jf.info.args[n];
+    llvm::Type *argTy = func->getArg(n)->getType();
+    llvm::Value *slot = b.CreateConstInBoundsGEP1_32(b.getInt8Ty(), buffer, jf.argOffsets[n]);
+    if (arg.isArray) {
+      callArgs.push_back(b.CreateBitCast(slot, argTy));
+    } else {
+      callArgs.push_back(generateBufferLoad(b, slot, arg, argTy));
+    }
+  }
+
+  llvm::Value *resultSlot = b.CreateConstInBoundsGEP1_32(b.getInt8Ty(), buffer, jf.resultOffset);
+  if (jf.info.result.isArray) {
+    callArgs.push_back(b.CreateBitCast(resultSlot, func->getArg(callArgs.size())->getType()));
+  }
+
+  llvm::Value *result = b.CreateCall(func, callArgs);
+
+  if (!jf.info.result.isArray) {
+    generateBufferStore(b, resultSlot, jf.info.result, result);
+  }
+  b.CreateRetVoid();
+
+  return wrapper->getName().str();
+}
+
+
+void
+jitAddModule(std::unique_ptr<llvm::Module> mod,
+             std::unique_ptr<llvm::LLVMContext> context,
+             const JitFunctionInfo& info)
+{
+  llvm::orc::LLJIT *jit = getJit();
+
+  llvm::Function *func = mod->getFunction(info.funcName);
+  log_assert(func);
+  log_assert(func->arg_size() == info.args.size() + (info.result.isArray ? 1 : 0));
+
+  if (mod->getDataLayout().isDefault()) {
+    mod->setDataLayout(jit->getDataLayout());
+  }
+
+  JitFunction jf;
+  jf.info = info;
+  layoutBuffer(jf);
+  std::string wrapperName = generateWrapper(mod.get(), func, jf);
+
+  // Each module gets a JITDylib of its own, since sub-functions of
+  // different modules have the same names, and a function may be
+  // generated again by a later func_extract run.
+  auto jd = jit->createJITDylib("jit_;_" + std::to_string(jitDylibCount++));
+  if (!jd) {
+    log_warning("Cannot JIT-compile %s: %s\n", info.funcName.c_str(),
+                llvm::toString(jd.takeError()).c_str());
+    return;
+  }
+
+  // For library calls such as memcpy
+  auto processSymbols = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                          jit->getDataLayout().getGlobalPrefix());
+  if (processSymbols) {
+    jd->addGenerator(std::move(*processSymbols));
+  } else {
+    llvm::consumeError(processSymbols.takeError());
+  }
+
+  llvm::orc::ThreadSafeModule tsm(std::move(mod), std::move(context));
+  if (llvm::Error err = jit->addIRModule(*jd, std::move(tsm))) {
+    log_warning("Cannot JIT-compile %s: %s\n", info.funcName.c_str(),
+                llvm::toString(std::move(err)).c_str());
+    return;
+  }
+
+  auto sym = jit->lookup(*jd, wrapperName);
+  if (!sym) {
+    log_warning("Cannot JIT-compile %s: %s\n", info.funcName.c_str(),
+                llvm::toString(sym.takeError()).c_str());
+    return;
+  }
+
+  jf.entry = reinterpret_cast<void (*)(uint8_t*)>(sym->getAddress());
+  jitFunctions[info.funcName] = std::move(jf);
+  log("JIT-compiled %s\n", info.funcName.c_str());
+}
+
+
+// Copy the value into the buffer, element by element, little-endian.
+// Undefined bits become zero.
+static void
+packValue(const JitValueInfo& value, const RTLIL::Const& val, uint8_t *slot)
+{
+  int stride = elementBytes(value);
+  for (int e = 0; e < value.numElems; ++e) {
+    uint8_t *elem = slot + e * stride;
+    for (int i = 0; i < value.width; ++i) {
+      if (val.bits[e * value.width + i] == RTLIL::State::S1) {
+        elem[i / 8] |= 1 << (i % 8);
+      }
+    }
+  }
+}
+
+
+static RTLIL::Const
+unpackValue(const JitValueInfo& value, const uint8_t *slot)
+{
+  RTLIL::Const val(RTLIL::State::S0, value.totalWidth());
+  int stride = elementBytes(value);
+  for (int e = 0; e < value.numElems; ++e) {
+    const uint8_t *elem = slot + e * stride;
+    for (int i = 0; i < value.width; ++i) {
+      if (elem[i / 8] & (1 << (i % 8))) {
+        val.bits[e * value.width + i] = RTLIL::State::S1;
+      }
+    }
+  }
+  return val;
+}
+
+
+static RTLIL::Const
+runJitFunction(const JitFunction& jf, const std::vector<RTLIL::Const>& argValues)
+{
+  std::vector<uint64_t> buffer((jf.bufferSize + 7) / 8, 0);
+  uint8_t *bytes = reinterpret_cast<uint8_t*>(buffer.data());
+
+  for (size_t n = 0; n < jf.info.args.size(); ++n) {
+    packValue(jf.info.args[n], argValues[n], bytes + jf.argOffsets[n]);
+  }
+
+  jf.entry(bytes);
+
+  return unpackValue(jf.info.result, bytes + jf.resultOffset);
+}
+
+
+// The ports of value, concatenated in element order.  Returns false if
+// a port is missing from the module.
+static bool
+getValueSig(RTLIL::Module *mod, const JitValueInfo& value, RTLIL::SigSpec& sig)
+{
+  sig = RTLIL::SigSpec();
+  if (!value.isArray) {
+    RTLIL::Wire *wire = mod->wire(value.ports.at(0));
+    if (!wire || wire->width != value.totalWidth()) {
+      return false;
+    }
+    sig = wire;
+    return true;
+  }
+
+  for (RTLIL::IdString portName : value.ports) {
+    RTLIL::Wire *wire = portName.empty() ? nullptr : mod->wire(portName);
+    if (wire && wire->width == value.width) {
+      sig.append(wire);
+    } else if (portName.empty()) {
+      sig.append(RTLIL::Const(RTLIL::State::Sx, value.width));
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// Evaluate the function's target in the unrolled module with ConstEval.
+// Returns false if that cannot be done, e.g. because the module holds
+// cells that ConstEval does not know, such as memory access cells.
+static bool
+evalWithConstEval(RTLIL::Module *mod, const JitFunctionInfo& info,
+                  const std::vector<RTLIL::Const>& argValues, RTLIL::Const& result)
+{
+  ConstEval ce(mod);
+
+  for (size_t n = 0; n < info.args.size(); ++n) {
+    RTLIL::SigSpec sig;
+    if (!getValueSig(mod, info.args[n], sig)) {
+      return false;
+    }
+    for (int i = 0; i < sig.size(); ++i) {
+      if (sig[i].wire) {
+        ce.set(sig[i], RTLIL::Const(argValues[n].bits[i]));
+      }
+    }
+  }
+
+  RTLIL::SigSpec sig, undef;
+  if (!getValueSig(mod, info.result, sig) || !ce.eval(sig, undef)) {
+    return false;
+  }
+  result = sig.as_const();
+  return true;
+}
+
+
+// Compare only the bits that ConstEval found to be defined.
+static bool
+sameDefinedBits(const RTLIL::Const& jitValue, const RTLIL::Const& refValue)
+{
+  for (int i = 0; i < GetSize(refValue); ++i) {
+    RTLIL::State ref = refValue.bits[i];
+    if ((ref == RTLIL::State::S0 || ref == RTLIL::State::S1) && ref != jitValue.bits[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static RTLIL::Const
+randomConst(std::mt19937& rng, int width)
+{
+  RTLIL::Const val(RTLIL::State::S0, width);
+  for (int i = 0; i < width; ++i) {
+    if (rng() & 1) {
+      val.bits[i] = RTLIL::State::S1;
+    }
+  }
+  return val;
+}
+
+
+PRIVATE_NAMESPACE_BEGIN
+
+
+struct FuncExtractEvalCmd : public Pass {
+
+  FuncExtractEvalCmd() : Pass("func_extract_eval", "Run JIT-compiled ILA update functions") { }
+
+  void help() override
+  {
+    //   |---v---|---v---|---v---|---v---|---v---|---v---|---v---|---v---|---v---|---v---|
+    log("\n");
+    log("    func_extract_eval [options]\n");
+    log("\n");
+    log("Run an update function that was compiled by 'func_extract -jit', and check\n");
+    log("its result against the unrolled module, evaluated with ConstEval (as by the\n");
+    log("'eval' command). The check is skipped if the unrolled module contains\n");
+    log("cells that ConstEval cannot evaluate, such as memory access cells.\n");
+    log("\n");
+    log("    -list\n");
+    log("        List the JIT-compiled functions and their args.\n");
+    log("\n");
+    log("    -func <name>\n");
+    log("        The function to run.\n");
+    log("\n");
+    log("    -set <arg> <value>\n");
+    log("        Set the given function arg (as named by -list) to a constant value\n");
+    log("        such as 16'h1234. An ASV array arg takes the concatenation of its\n");
+    log("        elements, with element 0 in the least significant bits. Other args\n");
+    log("        are zero, unless -random is used.\n");
+    log("\n");
+    log("    -random <n>\n");
+    log("        Run the function n times, with random values for the args that\n");
+    log("        are not set. Only mismatches are logged in detail.\n");
+    log("\n");
+    log("    -seed <n>\n");
+    log("        Seed for -random. The default is 0.\n");
+    log("\n");
+    log("    -assert\n");
+    log("        Fail if any result does not match ConstEval.\n");
+    log("\n");
+  }
+
+  void execute(std::vector<std::string> args, RTLIL::Design *design) override
+  {
+    bool list = false;
+    std::string funcName;
+    std::vector<std::pair<std::string, std::string>> sets;
+    int trials = 0;
+    unsigned seed = 0;
+    bool assertMatch = false;
+
+    log_header(design, "Executing FUNC_EXTRACT_EVAL.\n");
+
+    size_t argidx;
+    for (argidx = 1; argidx < args.size(); argidx++) {
+      std::string arg = args[argidx];
+      if (arg == "-list") {
+        list = true;
+      } else if (arg == "-func" && argidx < args.size()-1) {
+        funcName = args[++argidx];
+      } else if (arg == "-set" && argidx < args.size()-2) {
+        sets.push_back({args[argidx+1], args[argidx+2]});
+        argidx += 2;
+      } else if (arg == "-random" && argidx < args.size()-1) {
+        trials = std::stoi(args[++argidx]);
+      } else if (arg == "-seed" && argidx < args.size()-1) {
+        seed = std::stoul(args[++argidx]);
+      } else if (arg == "-assert") {
+        assertMatch = true;
+      } else {
+        break;
+      }
+    }
+    extra_args(args, argidx, design, false);
+
+    if (list) {
+      for (auto& nameFunc : jitFunctions) {
+        const JitFunctionInfo& info = nameFunc.second.info;
+        log("%s: target %s, %zu args, from module %s\n", info.funcName.c_str(),
+            info.targetName.c_str(), info.args.size(), log_id(info.rtlModName));
+        for (const JitValueInfo& arg : info.args) {
+          log("    %s: %d bits%s\n", arg.name.c_str(), arg.totalWidth(),
+              arg.isArray ? " (ASV array)" : "");
+        }
+      }
+      return;
+    }
+
+    if (funcName.empty()) {
+      log_cmd_error("No function given. Use -func <name>, or -list to see them.\n");
+    }
+    auto it = jitFunctions.find(funcName);
+    if (it == jitFunctions.end()) {
+      log_cmd_error("No JIT-compiled function %s. Run 'func_extract -jit' first.\n",
+                    funcName.c_str());
+    }
+    const JitFunction& jf = it->second;
+    const JitFunctionInfo& info = jf.info;
+
+    // The values given by -set
+    dict<int, RTLIL::Const> fixedValues;
+    for (auto& nameValue : sets) {
+      int n = 0;
+      while (n < GetSize(info.args) && info.args[n].name != nameValue.first) {
+        ++n;
+      }
+      if (n == GetSize(info.args)) {
+        log_cmd_error("Function %s has no arg %s.\n", funcName.c_str(), nameValue.first.c_str());
+      }
+
+      RTLIL::SigSpec sig;
+      if (!RTLIL::SigSpec::parse(sig, nullptr, nameValue.second) || !sig.is_fully_const()) {
+        log_cmd_error("Invalid value %s for arg %s.\n", nameValue.second.c_str(),
+                      nameValue.first.c_str());
+      }
+      sig.extend_u0(info.args[n].totalWidth());
+      fixedValues[n] = sig.as_const();
+    }
+
+    RTLIL::Module *mod = design->module(info.rtlModName);
+    if (!mod) {
+      log_warning("Unrolled module %s is not in the design, so results cannot be checked.\n",
+                  log_id(info.rtlModName));
+    }
+
+    std::mt19937 rng(seed);
+    int numRuns = std::max(trials, 1);
+    int numMismatches = 0;
+    int numUnchecked = 0;
+
+    for (int run = 0; run < numRuns; ++run) {
+      std::vector<RTLIL::Const> argValues;
+      for (int n = 0; n < GetSize(info.args); ++n) {
+        int width = info.args[n].totalWidth();
+        if (fixedValues.count(n)) {
+          argValues.push_back(fixedValues.at(n));
+        } else if (trials > 0) {
+          argValues.push_back(randomConst(rng, width));
+        } else {
+          argValues.push_back(RTLIL::Const(RTLIL::State::S0, width));
+        }
+      }
+
+      RTLIL::Const jitValue = runJitFunction(jf, argValues);
+      RTLIL::Const refValue;
+      bool checked = mod && evalWithConstEval(mod, info, argValues, refValue);
+      bool match = !checked || sameDefinedBits(jitValue, refValue);
+
+      if (!checked) {
+        numUnchecked++;
+      } else if (!match) {
+        numMismatches++;
+      }
+
+      if (trials == 0 || !match) {
+        if (trials > 0) {
+          log("Run %d:\n", run+1);
+        }
+        for (int n = 0; n < GetSize(info.args); ++n) {
+          log("  %s = %s\n", info.args[n].name.c_str(), log_const(argValues[n], false));
+        }
+        log("  %s returns %s\n", funcName.c_str(), log_const(jitValue, false));
+        if (checked) {
+          log("  ConstEval: %s%s\n", log_const(refValue, false), match ? "" : "  MISMATCH");
+        }
+      }
+    }
+
+    log("%d runs of %s: %d mismatches, %d not checked.\n", numRuns, funcName.c_str(),
+        numMismatches, numUnchecked);
+
+    if (assertMatch && numMismatches > 0) {
+      log_error("%s does not match ConstEval.\n", funcName.c_str());
+    }
+  }
+
+} FuncExtractEvalCmd;
+
+PRIVATE_NAMESPACE_END
@@ -0,0 +1,54 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "kernel/yosys.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+  class LLVMContext;
+  class Module;
+}
+
+// With func_extract -jit, each update function is compiled in-process with
+// the LLVM ORC JIT as soon as it has been written, and kept for the
+// func_extract_eval command, which runs it and checks the results against
+// ConstEval evaluation of the unrolled module.
+
+
+// One function arg or result, and the unrolled module ports it corresponds to.
+struct JitValueInfo {
+  std::string name;      // LLVM arg name
+  int width = 0;         // Of each element
+  int numElems = 1;      // More than one for memories and ASV arrays
+  bool isArray = false;  // An ASV array, passed by pointer to padded elements
+
+  // For an ASV array, the port of each element (empty if there is none).
+  // Otherwise a single port holding all the elements.
+  std::vector<Yosys::RTLIL::IdString> ports;
+
+  int totalWidth() const { return width * numElems; }
+};
+
+
+struct JitFunctionInfo {
+  std::string funcName;
+  std::string targetName;
+  Yosys::RTLIL::IdString rtlModName;  // The unrolled module
+  std::vector<JitValueInfo> args;     // In order, not including a return array
+  JitValueInfo result;                // For an ASV array target, the return array
+};
+
+
+// Compile mod, which holds the function info.funcName, and keep it for
+// func_extract_eval.  The JIT takes ownership of the module and of its
+// context, which it must not share with any other module.  Failures are
+// only warnings, since the LLVM files have still been written.
+void jitAddModule(std::unique_ptr<llvm::Module> mod,
+                  std::unique_ptr<llvm::LLVMContext> context,
+                  const JitFunctionInfo& info);
+
+
+#endif
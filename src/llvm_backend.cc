@@ -0,0 +1,124 @@
+#include "llvm_backend.h"
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include <memory>
+#include <mutex>
+
+
+// Make a TargetMachine for the host.  Returns null if there is none.
+static std::unique_ptr<llvm::TargetMachine>
+createHostTargetMachine(std::string& error)
+{
+  static std::once_flag initialized;
+  std::call_once(initialized, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+  });
+
+  std::string triple = llvm::sys::getDefaultTargetTriple();
+  const llvm::Target *target = llvm::TargetRegistry::lookupTarget(triple, error);
+  if (!target) {
+    return nullptr;
+  }
+
+  llvm::TargetOptions options;
+  return std::unique_ptr<llvm::TargetMachine>(
+            target->createTargetMachine(triple, llvm::sys::getHostCPUName(), "",
+                                        options, llvm::Reloc::PIC_));
+}
+
+
+// Set the module's triple and data layout, which the optimizer and code
+// generator both depend on.
+static void
+setHostTarget(llvm::Module *mod, llvm::TargetMachine *tm)
+{
+  mod->setTargetTriple(tm->getTargetTriple().str());
+  mod->setDataLayout(tm->createDataLayout());
+}
+
+
+bool
+checkPassPipeline(const std::string& pipeline, std::string& error)
+{
+  llvm::PassBuilder pb;
+  llvm::ModulePassManager mpm;
+  if (llvm::Error err = pb.parsePassPipeline(mpm, pipeline)) {
+    error = llvm::toString(std::move(err));
+    return false;
+  }
+  return true;
+}
+
+
+bool
+runPassPipeline(llvm::Module *mod, const std::string& pipeline, std::string& error)
+{
+  std::unique_ptr<llvm::TargetMachine> tm = createHostTargetMachine(error);
+  if (!tm) {
+    return false;
+  }
+  setHostTarget(mod, tm.get());
+
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+
+  llvm::PassBuilder pb(tm.get());
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  llvm::ModulePassManager mpm;
+  if (llvm::Error err = pb.parsePassPipeline(mpm, pipeline)) {
+    error = llvm::toString(std::move(err));
+    return false;
+  }
+
+  mpm.run(*mod, mam);
+  return true;
+}
+
+
+bool
+emitObjectFile(llvm::Module *mod, const std::string& fileName, std::string& error)
+{
+  std::unique_ptr<llvm::TargetMachine> tm = createHostTargetMachine(error);
+  if (!tm) {
+    return false;
+  }
+  setHostTarget(mod, tm.get());
+
+  std::error_code ec;
+  llvm::raw_fd_ostream output(fileName, ec, llvm::sys::fs::OF_None);
+  if (ec) {
+    error = ec.message();
+    return false;
+  }
+
+  // Code generation still uses the legacy pass manager.
+  llvm::legacy::PassManager pm;
+  if (tm->addPassesToEmitFile(pm, output, nullptr, llvm::CGFT_ObjectFile)) {
+    error = "the target cannot emit object files";
+    return false;
+  }
+
+  pm.run(*mod);
+  output.flush();
+  return true;
+}
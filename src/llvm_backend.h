@@ -0,0 +1,25 @@
+#ifndef LLVM_BACKEND_H
+#define LLVM_BACKEND_H
+
+#include <string>
+
+namespace llvm {
+  class Module;
+}
+
+// In-process replacements for running 'opt' and 'llc' on generated LLVM
+// modules.  These do not use Yosys, so they may be called on worker threads.
+// On failure they return false and describe the problem in error.
+
+// Return true if the given pipeline (in 'opt -passes=...' syntax, e.g.
+// "default<O3>") can be parsed.
+bool checkPassPipeline(const std::string& pipeline, std::string& error);
+
+// Run the pipeline on mod, targeting the host machine.
+bool runPassPipeline(llvm::Module *mod, const std::string& pipeline, std::string& error);
+
+// Compile mod to a native object file for the host machine.
+bool emitObjectFile(llvm::Module *mod, const std::string& fileName, std::string& error);
+
+
+#endif
@@ -0,0 +1,62 @@
+#include "thread_pool.h"
+
+
+ThreadPool::ThreadPool(int numThreads)
+{
+  for (int n = 0; n < numThreads; ++n) {
+    threads.emplace_back(&ThreadPool::run, this);
+  }
+}
+
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cv.notify_all();
+
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+
+std::future<void>
+ThreadPool::submit(std::function<void()> job)
+{
+  std::packaged_task<void()> task(std::move(job));
+  std::future<void> result = task.get_future();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push(std::move(task));
+  }
+  cv.notify_one();
+
+  return result;
+}
+
+
+// The body of each thread: run jobs until the pool is destroyed and
+// there are no more jobs.
+void
+ThreadPool::run()
+{
+  while (true) {
+    std::packaged_task<void()> task;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+      if (jobs.empty()) {
+        return;  // Stopping
+      }
+      task = std::move(jobs.front());
+      jobs.pop();
+    }
+
+    task();
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+// A fixed number of threads that run submitted jobs in submission order.
+// Jobs must not touch the Yosys design or call the Yosys log functions,
+// neither of which is thread-safe.
+class ThreadPool {
+public:
+  explicit ThreadPool(int numThreads);
+  ~ThreadPool();  // Waits for all submitted jobs to finish
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // The returned future becomes ready when the job has run.
+  std::future<void> submit(std::function<void()> job);
+
+  int size() const { return (int)threads.size(); }
+
+private:
+  void run();
+
+  std::vector<std::thread> threads;
+  std::queue<std::packaged_task<void()>> jobs;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping = false;
+};
+
+
+#endif
@@ -21,11 +21,13 @@
 USING_YOSYS_NAMESPACE  // Does "using namespace"
 
 
-YosysUFGenerator::YosysUFGenerator(RTLIL::Module *srcmod, const Options& opts)
+YosysUFGenerator::YosysUFGenerator(RTLIL::Module *srcmod, const Options& opts,
+                                   std::shared_ptr<UnrollCache> unrollCache)
 {
   m_srcmod = srcmod;
   m_des = srcmod->design;
   m_opts = opts;
+  m_unrollCache = unrollCache;
 }
 
 
@@ -34,6 +36,64 @@ YosysUFGenerator::~YosysUFGenerator()
 }
 
 
+void
+UnrollCache::finishMultiTarget()
+{
+  if (multiTargetWriter) {
+    multiTargetWriter->finish_multi_target();
+    multiTargetWriter.reset();
+  }
+  multiTargetModName = RTLIL::IdString();
+}
+
+
+void
+UnrollCache::finishPrefetch()
+{
+  for (auto& it : prefetched) {
+    it.second.finished.wait();
+  }
+  if (!prefetched.empty()) {
+    log("%d targets generated in advance were not used\n", GetSize(prefetched));
+  }
+  prefetched.clear();
+  prefetchModName = RTLIL::IdString();
+}
+
+
+void
+UnrollCache::finishInstruction(RTLIL::Design *design, bool keepModule)
+{
+  finishMultiTarget();
+  finishPrefetch();
+
+  if (!keepModule && !currentModName.empty()) {
+    RTLIL::Module *mod = design->module(currentModName);
+    if (mod) {
+      log("Removing unrolled module %s\n", id2cstr(currentModName));
+      design->remove(mod);
+    }
+  }
+  currentModName = RTLIL::IdString();
+}
+
+
+void
+UnrollCache::purge(RTLIL::Design *design)
+{
+  if (base.destmod) {
+    design->remove(base.destmod);
+  }
+  base = UnrollState();
+
+  for (auto& it : templates) {
+    design->remove(it.second);
+  }
+  templates.clear();
+  templateOrder.clear();
+}
+
+
 
 
 // Translate the given string (something as complicated as
@@ -235,22 +295,316 @@ YosysUFGenerator::applyInstrEncoding(RTLIL::Module* mod, const funcExtract::Inst
 
 
 
+// Make a copy of the given module with a new name, and add it to the design.
+// This is much faster than unrolling from scratch, since no names or
+// SigSpecs have to be re-mapped.
+
+static RTLIL::Module *
+copyModule(RTLIL::Module *mod, RTLIL::IdString newName)
+{
+  RTLIL::Module *newMod = mod->clone();
+  newMod->name = newName;
+  mod->design->add(newMod);
+  return newMod;
+}
+
+
+
+// Fill in the internal names of all the target ASVs, including the members
+// of ASV register arrays.
+
+static void
+getTargetNames(pool<RTLIL::IdString>& targets)
+{
+  for (auto pair : funcExtract::g_allowedTgt) {
+    targets.insert(verilogToInternal(pair.first));
+  }
+  for (auto pair: funcExtract::g_allowedTgtVec) {
+    for (const std::string& member : pair.second.members) {
+      targets.insert(verilogToInternal(member));
+    }
+  }
+}
+
+
+
+// Fill in the constant values that the given instruction puts on srcmod
+// signals in each cycle of an unrolling, for the fold_constants option.
+// These are the instruction encoding (or NOP) values of the input ports, as
+// applied by applyInstrEncoding(), and the cycle-1 reset values of the
+// registers that are not ASVs.  The vector is indexed by cycle.
+
+void
+YosysUFGenerator::getUnrollConstants(funcExtract::InstrInfo_t& instrInfo, int num_cycles,
+                                     std::vector<dict<RTLIL::IdString, RTLIL::Const>>& constInputs)
+{
+  constInputs.clear();
+  constInputs.resize(num_cycles+2);
+
+  auto addConst = [&](const std::string& name, const std::string& valStr, int cycle) {
+    RTLIL::IdString wirename = verilogToInternal(name);
+    RTLIL::Wire *wire = m_srcmod->wire(wirename);
+    if (!wire) {
+      return;
+    }
+    RTLIL::SigSpec ss;
+    getSigSpec(valStr, ss);
+    if (ss.empty() || !ss.is_fully_const()) {
+      return;  // An error will be reported when the value is applied
+    }
+    adjustSigSpecWidth(ss, wire->width);
+    constInputs[cycle][wirename] = ss.as_const();
+  };
+
+  for (auto pair : instrInfo.instrEncoding) {
+    const std::string& inputName = pair.first;
+    const std::vector<std::string>& values = pair.second;
+    for (int cycle = 1; cycle <= num_cycles+1; ++cycle) {
+      if ((unsigned)cycle <= values.size()) {
+        addConst(inputName, values[cycle-1], cycle);
+      } else if (funcExtract::g_nopInstr.count(inputName)) {
+        addConst(inputName, funcExtract::g_nopInstr[inputName], cycle);
+      }
+    }
+  }
+
+  pool<RTLIL::IdString> targets;
+  getTargetNames(targets);
+  for (auto pair : funcExtract::g_rstVal) {
+    RTLIL::IdString wirename = verilogToInternal(pair.first);
+    if (!targets.count(wirename) && !constInputs[1].count(wirename)) {
+      addConst(pair.first, pair.second, 1);
+    }
+  }
+}
+
+
+
+// The key of a target in UnrollCache::prefetched: its name, and whether it is
+// written as a vector target.  A memory vector is written like a single ASV.
+
+static std::pair<std::string, bool>
+prefetchKey(const std::string& targetName, bool isVector, bool isMemVec)
+{
+  return {targetName, isVector && !isMemVec};
+}
+
+
+// The file that the flow will write the given target of the current
+// instruction to, going by the file it gave curTarget.  Empty if the file
+// name does not include the target name.
+
+static std::string
+targetFileName(const std::string& curTarget, const std::string& curFileName,
+               const std::string& target)
+{
+  size_t pos = curFileName.rfind(curTarget);
+  if (pos == std::string::npos) {
+    return std::string();
+  }
+  return curFileName.substr(0, pos) + target + curFileName.substr(pos+curTarget.size());
+}
+
+
+// With the threads option, generate the LLVM for the other target ASVs of an
+// instruction as soon as its unrolled module is ready.  Generation reads the
+// Yosys design, which is not thread-safe, so it is done here one target after
+// another.  But each target gets its own LLVMWriter (and so its own
+// LLVMContext), and finishing it (verification, mux-to-branch conversion and
+// the opt pipeline) is handed to the thread pool, overlapping the generation
+// of the next targets.  print_llvm_ir() then only needs to wait for the
+// target's result and write it out.  Only the targets the instruction writes
+// are generated, and like the flow, this skips those whose file already
+// exists, unless existing files are to be overwritten.
+
+static void
+prefetchTargets(UnrollCache& cache, RTLIL::Design *des, RTLIL::Module *unrolledMod,
+                funcExtract::InstrInfo_t& instrInfo,
+                const std::string& curTarget, const std::string& curFileName,
+                const std::string& origModName, int num_cycles,
+                const LLVMWriter::Options& llvmOpts)
+{
+  // With no write ASVs given, the instruction may write any target.
+  auto writes = [&instrInfo](const std::string& target) {
+    return instrInfo.writeASV.empty() || instrInfo.writeASV.count(target);
+  };
+
+  std::vector<std::pair<std::string, bool>> targets;
+  for (auto pair : funcExtract::g_allowedTgt) {
+    if (writes(pair.first)) {
+      targets.push_back(prefetchKey(pair.first, false, false));
+    }
+  }
+  for (auto pair : funcExtract::g_allowedTgtVec) {
+    if (!writes(pair.first)) {
+      continue;
+    }
+    // A memory vector has a single output port, not one per member.
+    RTLIL::Wire *port = unrolledMod->wire(cycleize_name(pair.first, num_cycles+1));
+    bool isMemVec = port && port->port_output;
+    targets.push_back(prefetchKey(pair.first, true, isMemVec));
+  }
+
+  for (auto& target : targets) {
+    if (!funcExtract::g_overwrite_existing_llvm && target.first != curTarget) {
+      std::string fileName = targetFileName(curTarget, curFileName, target.first);
+      if (!fileName.empty() && std::ifstream(fileName).good()) {
+        continue;
+      }
+    }
+
+    // Skip targets that the unrolled module has no output ports for.
+    RTLIL::IdString portName = cycleize_name(target.first, num_cycles+1);
+    bool found = false;
+    if (!target.second) {
+      RTLIL::Wire *port = unrolledMod->wire(portName);
+      found = port && port->port_output;
+    } else {
+      for (RTLIL::Wire *port : unrolledMod->wires()) {
+        if (port->port_output &&
+            port->get_string_attribute(TARGET_VECTOR_ATTR) == portName.str().substr(1)) {
+          found = true;
+          break;
+        }
+      }
+    }
+    if (!found) {
+      continue;
+    }
+
+    log("Generating LLVM for target %s in advance\n", target.first.c_str());
+
+    std::shared_ptr<LLVMWriter> writer = std::make_shared<LLVMWriter>(des, llvmOpts);
+    writer->setSharedDriverFinder(&cache.finder);
+    writer->generate_llvm_ir(unrolledMod, target.first, target.second, origModName,
+                             num_cycles, target.first);
+
+    UnrollCache::PrefetchedTarget& prefetched = cache.prefetched[target];
+    prefetched.writer = writer;
+    prefetched.finished = cache.threadPool->submit([writer] { writer->finish_llvm_ir(); });
+  }
+}
+
+
+
+// Make a new module with the given name, holding srcmod unrolled for
+// num_cycles+1 cycles, but with nothing instruction-specific applied to it.
+// If possible, this is done by copying the cached base unrolling (first
+// extending it by however many cycles it is short).  The base unrolling
+// cannot be shrunk, so if it already has too many cycles we unroll from
+// scratch.  With the coi_unroll option, only the cone of influence of the
+// target ASVs is unrolled, always from scratch.
+
 RTLIL::Module *
-YosysUFGenerator::makeUnrolledModule(RTLIL::IdString unrolledModName, RTLIL::Module *srcmod,
-                   funcExtract::InstrInfo_t& instrInfo, int num_cycles)
+YosysUFGenerator::makeRawUnrolledModule(RTLIL::IdString unrolledModName, RTLIL::Module *srcmod,
+                                        int num_cycles)
 {
   RTLIL::Design *design = srcmod->design;
-  
-  RTLIL::Module *unrolledMod = design->addModule(unrolledModName);
-  log_assert(unrolledMod);
+  UnrollState& base = m_unrollCache->base;
+
+  if (!base.destmod && !m_opts.coi_unroll) {
+    RTLIL::IdString baseModName = RTLIL::escape_id(internalToV(srcmod->name)+"_unrolled_base");
+    base.srcmod = srcmod;
+    base.destmod = design->addModule(baseModName);
+    log_assert(base.destmod);
+    base.destmod->set_bool_attribute("\\func_extract_unrolled_base");
+  }
+
+  RTLIL::Module *unrolledMod = nullptr;
+
+  if (m_opts.coi_unroll) {
+    // The cone of influence depends on the cycle count, so a pruned
+    // unrolling cannot be extended, and is always made from scratch.
+    pool<RTLIL::IdString> targets;
+    getTargetNames(targets);
+
+    unrolledMod = design->addModule(unrolledModName);
+    log_assert(unrolledMod);
+
+    log("Unrolling the cone of influence of module `%s' into `%s' for %d cycles...\n",
+        id2cstr(srcmod->name), id2cstr(unrolledModName), num_cycles);
+    unroll_module(srcmod, unrolledMod, num_cycles, &targets);
+
+  } else if (base.srcmod == srcmod && base.cycles <= num_cycles+1) {
+    if (base.cycles < num_cycles+1) {
+      log("Extending cached unrolling of module `%s' from %d to %d cycles...\n",
+          id2cstr(srcmod->name), std::max(base.cycles-1, 0), num_cycles);
+      extend_unrolled_module(base, num_cycles);
+    }
+
+    log("Copying cached unrolling of module `%s' into `%s'...\n",
+        id2cstr(srcmod->name), id2cstr(unrolledModName));
+    unrolledMod = copyModule(base.destmod, unrolledModName);
+    unrolledMod->attributes.erase("\\func_extract_unrolled_base");
+  } else {
+    unrolledMod = design->addModule(unrolledModName);
+    log_assert(unrolledMod);
+
+    log("Unrolling module `%s' into `%s' for %d cycles...\n",
+        id2cstr(srcmod->name), id2cstr(unrolledModName), num_cycles);
+    unroll_module(srcmod, unrolledMod, num_cycles);
+  }
+
+  return unrolledMod;
+}
 
-  // Mark the module as a special temporary unrolled module
-  // TODO: set more attributes so we don't have to parse module names.
-  unrolledMod->set_bool_attribute("\\func_extract_unrolled");
 
-  log("Unrolling module `%s' into `%s' for %d cycles...\n",
-      id2cstr(srcmod->name), id2cstr(unrolledModName), num_cycles);
-  unroll_module(srcmod, unrolledMod, num_cycles);
+
+// The most unroll templates kept at once.  Each is a whole unrolled module.
+static const int MAX_UNROLL_TEMPLATES = 4;
+
+
+// Return the unroll template for the given cycle count, creating it if
+// necessary.  A template is an unrolled module with everything done to it
+// that does not depend on the instruction: the final-cycle ASV signals are
+// made into output ports, the ASV ports are annotated, and $pmux cells are
+// optionally removed.  All instructions with the same cycle count get a
+// copy of the same template.  When there are too many templates, the least
+// recently used one is removed from the design.
+
+RTLIL::Module *
+YosysUFGenerator::getUnrollTemplate(RTLIL::Module *srcmod, int num_cycles)
+{
+  std::vector<int>& order = m_unrollCache->templateOrder;
+
+  auto it = m_unrollCache->templates.find(num_cycles);
+  if (it != m_unrollCache->templates.end()) {
+    log("Re-using unroll template %s\n", id2cstr(it->second->name));
+    order.erase(std::find(order.begin(), order.end(), num_cycles));
+    order.push_back(num_cycles);
+    return it->second;
+  }
+
+  if (GetSize(order) >= MAX_UNROLL_TEMPLATES) {
+    RTLIL::Module *oldTemplate = m_unrollCache->templates.at(order.front());
+    log("Removing unroll template %s\n", id2cstr(oldTemplate->name));
+    m_des->remove(oldTemplate);
+    m_unrollCache->templates.erase(order.front());
+    order.erase(order.begin());
+  }
+
+  RTLIL::IdString templateModName =
+      RTLIL::escape_id(internalToV(srcmod->name)+"_unrolled_template_"+std::to_string(num_cycles));
+  RTLIL::Module *unrolledMod = makeRawUnrolledModule(templateModName, srcmod, num_cycles);
+  unrolledMod->set_bool_attribute("\\func_extract_unrolled_template");
+  m_unrollCache->templates[num_cycles] = unrolledMod;
+  order.push_back(num_cycles);
+
+  prepareUnrolledModule(unrolledMod, num_cycles);
+
+  return unrolledMod;
+}
+
+
+
+// Do everything to a freshly unrolled module that does not depend on the
+// instruction: make the final-cycle ASV signals into output ports, annotate
+// the ASV ports, and optionally remove $pmux cells.
+
+void
+YosysUFGenerator::prepareUnrolledModule(RTLIL::Module *unrolledMod, int num_cycles)
+{
+  RTLIL::Design *design = unrolledMod->design;
 
   // Make into output ports the final-cycle (num_cycles+1) signals that
   // represent ASVs.  Typically these are the from_Q signals created by
@@ -341,7 +695,47 @@ YosysUFGenerator::makeUnrolledModule(RTLIL::IdString unrolledModName, RTLIL::Mod
     Pass::call_on_module(design, unrolledMod, "stat");
     log_pop();
   }
+}
+
+
+
+RTLIL::Module *
+YosysUFGenerator::makeUnrolledModule(RTLIL::IdString unrolledModName, RTLIL::Module *srcmod,
+                   funcExtract::InstrInfo_t& instrInfo, int num_cycles)
+{
+  RTLIL::Module *unrolledMod = nullptr;
+
+  if (m_opts.fold_constants) {
+    // The folded logic depends on the instruction encoding, so each
+    // instruction is unrolled from scratch rather than copied from a template.
+    std::vector<dict<RTLIL::IdString, RTLIL::Const>> constInputs;
+    getUnrollConstants(instrInfo, num_cycles, constInputs);
+
+    pool<RTLIL::IdString> targets;
+    if (m_opts.coi_unroll) {
+      getTargetNames(targets);
+    }
+
+    unrolledMod = srcmod->design->addModule(unrolledModName);
+    log_assert(unrolledMod);
+
+    log("Unrolling module `%s' into `%s' for %d cycles with constant folding...\n",
+        id2cstr(srcmod->name), id2cstr(unrolledModName), num_cycles);
+    unroll_module(srcmod, unrolledMod, num_cycles,
+                  m_opts.coi_unroll ? &targets : nullptr, &constInputs);
+    prepareUnrolledModule(unrolledMod, num_cycles);
+  } else {
+    RTLIL::Module *templateMod = getUnrollTemplate(srcmod, num_cycles);
+
+    log("Copying unroll template %s into %s...\n",
+        id2cstr(templateMod->name), id2cstr(unrolledModName));
+    unrolledMod = copyModule(templateMod, unrolledModName);
+    unrolledMod->attributes.erase("\\func_extract_unrolled_template");
+  }
 
+  // Mark the module as a special temporary unrolled module
+  // TODO: set more attributes so we don't have to parse module names.
+  unrolledMod->set_bool_attribute("\\func_extract_unrolled");
 
   // Doing opto here gives little improvement
 #if 0
@@ -433,6 +827,38 @@ YosysUFGenerator::makeUnrolledModule(RTLIL::IdString unrolledModName, RTLIL::Mod
 
 
 
+// Fill in what the LLVM writer needs to evaluate srcmod directly for the
+// given instruction, without unrolling it, apart from the encoding and reset
+// values (see getUnrollConstants()): which inputs are exposed, and the ASV
+// registers.
+
+static void
+getTimeFrameInfo(funcExtract::InstrInfo_t& instrInfo, LLVMWriter::TimeFrameInfo& timeFrame)
+{
+  // Like applyInstrEncoding(), expose x bits of the encoded inputs.
+  for (auto pair : instrInfo.instrEncoding) {
+    timeFrame.exposedInputs.insert(verilogToInternal(pair.first));
+  }
+
+  for (auto pair : funcExtract::g_allowedTgt) {
+    timeFrame.targets.insert(verilogToInternal(pair.first));
+  }
+
+  for (auto pair: funcExtract::g_allowedTgtVec) {
+    int idx = -1;
+    for (const std::string& member : pair.second.members) {
+      ++idx;
+      timeFrame.targetVectorMembers[verilogToInternal(member)] = {pair.first, idx};
+    }
+  }
+
+  if (!taintGen::g_recentClk.empty()) {
+    timeFrame.clock = verilogToInternal(taintGen::g_recentClk);
+  }
+}
+
+
+
 // Since this generator caches the unrolled design, it would be
 // most efficient to call print_llvm_ir repeatedly for each destination
 // of the same instruction.
@@ -460,13 +886,27 @@ YosysUFGenerator::print_llvm_ir(funcExtract::DestInfo &destInfo,
 
   // See if we can reuse any pre-existing unrolled module.
   // This will be the case as long as the instruction and
-  // the cycle count do not change.
-  // TODO: When do we purge no-longer-needed unrolled modules?
+  // the cycle count do not change.  Once they do, the previous
+  // instruction's module is no longer needed, except by the JIT.
 
   RTLIL::IdString unrolledModName = RTLIL::escape_id(instr_name+"_unrolled_"+std::to_string(num_cycles));
+  if (!m_opts.time_frame && m_unrollCache->currentModName != unrolledModName) {
+    m_unrollCache->finishInstruction(m_des, m_opts.jit);
+    m_unrollCache->currentModName = unrolledModName;
+  }
   RTLIL::Module *unrolledMod = m_des->module(unrolledModName);
 
-  if (unrolledMod) {
+  // In time-frame mode, no unrolled module is made at all.
+  LLVMWriter::TimeFrameInfo timeFrame;
+
+  if (m_opts.time_frame) {
+    log("Module %s will be evaluated directly in %d time frames.\n",
+        id2cstr(m_srcmod->name), num_cycles+1);
+    timeFrame.srcmod = m_srcmod;
+    timeFrame.num_cycles = num_cycles;
+    getUnrollConstants(instrInfo, num_cycles, timeFrame.values);
+    getTimeFrameInfo(instrInfo, timeFrame);
+  } else if (unrolledMod) {
     log("Re-using unrolled module %s\n", id2cstr(unrolledModName));
   } else {
     log("New unrolled module %s will be created.\n", id2cstr(unrolledModName));
@@ -505,16 +945,91 @@ YosysUFGenerator::print_llvm_ir(funcExtract::DestInfo &destInfo,
   llvmOpts.cell_based_llvm_value_names = m_opts.cell_based_llvm_value_names;
   llvmOpts.simplify_and_or_gates = m_opts.simplify_and_or_gates;
   llvmOpts.simplify_muxes = m_opts.simplify_muxes;
+  llvmOpts.plan_concat = m_opts.plan_concat;
+  llvmOpts.branch_facts = m_opts.branch_facts;
   llvmOpts.use_poison = m_opts.use_poison;
   llvmOpts.support_hierarchy = m_opts.support_hierarchy;
   llvmOpts.support_pmux = m_opts.support_pmux;
   llvmOpts.optimize_muxes = m_opts.optimize_muxes;
   llvmOpts.optimize_mux_threshold = m_opts.optimize_mux_threshold;
+  llvmOpts.step_loop = m_opts.step_loop;
+  llvmOpts.fused_update = m_opts.fused_update;
+  llvmOpts.bitcode = m_opts.bitcode;
+  llvmOpts.opt_pipeline = m_opts.opt_pipeline;
+  llvmOpts.emit_object = m_opts.emit_object;
+  llvmOpts.jit = m_opts.jit;
+  llvmOpts.state_struct_abi = m_opts.state_struct_abi;
+
+  // One pool of m_opts.threads threads builds the driver tables and finishes
+  // the targets generated in advance.
+  if (m_opts.threads > 1 && !m_unrollCache->threadPool) {
+    m_unrollCache->threadPool = std::make_shared<ThreadPool>(m_opts.threads);
+  }
+  llvmOpts.finder_pool = m_unrollCache->threadPool.get();
+
+  if (m_opts.time_frame) {
+    // pmuxtree cannot be run on the original module.
+    llvmOpts.support_pmux = true;
+    llvmOpts.support_hierarchy = false;
+  }
 
 
+  if (m_opts.multi_target) {
+    // All the targets of the instruction go into one LLVM module, which is
+    // written out when the flow moves on to another instruction.
+    if (m_unrollCache->multiTargetModName != unrolledModName) {
+      m_unrollCache->finishMultiTarget();
+
+      std::string dirName = fileName.substr(0, fileName.find_last_of('/')+1);
+      m_unrollCache->multiTargetWriter = std::make_shared<LLVMWriter>(m_des, llvmOpts);
+      m_unrollCache->multiTargetWriter->setSharedDriverFinder(&m_unrollCache->finder);
+      m_unrollCache->multiTargetWriter->begin_multi_target(unrolledMod, origModName, num_cycles,
+                                                           instr_name+"_all",
+                                                           dirName+instr_name+"_all"+
+                                                               (m_opts.bitcode ? ".bc" : ".ll"));
+      m_unrollCache->multiTargetModName = unrolledModName;
+    }
+
+    m_unrollCache->multiTargetWriter->add_multi_target(targetName, isVector, fileName, funcName);
+    return;
+  }
+
+  // Generating the targets in advance only pays off if finishing them takes
+  // real work that the thread pool can do in parallel, i.e. an opt pipeline.
+  // (Mux-to-branch conversion is done one module at a time, see
+  // finishModule().)
+  bool prefetch = m_opts.threads > 1 && !m_opts.time_frame && !llvmOpts.opt_pipeline.empty();
+
+  if (prefetch) {
+    if (m_unrollCache->prefetchModName != unrolledModName) {
+      m_unrollCache->finishPrefetch();
+      prefetchTargets(*m_unrollCache, m_des, unrolledMod, instrInfo, targetName, fileName,
+                      origModName, num_cycles, llvmOpts);
+      m_unrollCache->prefetchModName = unrolledModName;
+    }
+
+    auto it = m_unrollCache->prefetched.find(prefetchKey(targetName, destInfo.isVector,
+                                                         destInfo.isMemVec));
+    if (it != m_unrollCache->prefetched.end()) {
+      it->second.finished.wait();
+      it->second.writer->write_llvm_file(funcName, fileName);
+      m_unrollCache->prefetched.erase(it);
+      log("LLVM result written to %s\n", fileName.c_str());
+      return;
+    }
+
+    log("Target %s was not generated in advance\n", targetName.c_str());
+  }
+
   LLVMWriter writer(m_des, llvmOpts);
-  writer.write_llvm_ir(unrolledMod, targetName, isVector, origModName,
-                      num_cycles, fileName, funcName);
+  writer.setSharedDriverFinder(&m_unrollCache->finder);
+  if (m_opts.time_frame) {
+    writer.write_time_frame_llvm_ir(timeFrame, targetName, isVector, origModName,
+                                    fileName, funcName);
+  } else {
+    writer.write_llvm_ir(unrolledMod, targetName, isVector, origModName,
+                        num_cycles, fileName, funcName);
+  }
   log("LLVM result written to %s\n", fileName.c_str());
 
 }
@@ -8,6 +8,67 @@
 // Yosys headers
 #include "kernel/yosys.h"
 
+#include "unroll.h"
+#include "driver_tools.h"
+#include "thread_pool.h"
+
+class LLVMWriter;  // See write_llvm.h
+
+
+// Unrolled-module data that does not depend on any particular instruction.
+// It is shared by all the generators made by one factory.
+struct UnrollCache {
+  // An unrolling of the source module with no instruction encodings or reset
+  // values applied.  It grows as instructions with more cycles are
+  // encountered, and it is copied to make each instruction's unrolled module.
+  UnrollState base;
+
+  // Unroll templates, indexed by cycle count.  See getUnrollTemplate().
+  // Only the most recently used few are kept; templateOrder holds their
+  // cycle counts, least recently used first.
+  Yosys::dict<int, Yosys::RTLIL::Module*> templates;
+  std::vector<int> templateOrder;
+
+  // The driver finder of the module most recently written as LLVM.  All the
+  // targets of one instruction are written from the same unrolled module, so
+  // the finder only needs to be built once for them.
+  DriverFinder finder;
+
+  // In multi-target mode: the writer that is generating the targets of the
+  // current instruction, and the name of its unrolled module.
+  std::shared_ptr<LLVMWriter> multiTargetWriter;
+  Yosys::RTLIL::IdString multiTargetModName;
+
+  // Write out the multi-target LLVM module of the current instruction, if any.
+  void finishMultiTarget();
+
+  // With the threads option: the LLVM of the current instruction's targets,
+  // generated in advance, by target name and vector flag.  Each is ready to
+  // be written once its future is.
+  struct PrefetchedTarget {
+    std::shared_ptr<LLVMWriter> writer;
+    std::shared_future<void> finished;
+  };
+
+  // The pool also builds the driver tables.
+  std::shared_ptr<ThreadPool> threadPool;
+  Yosys::RTLIL::IdString prefetchModName;
+  std::map<std::pair<std::string, bool>, PrefetchedTarget> prefetched;
+
+  // Wait for and discard any unused prefetched targets.
+  void finishPrefetch();
+
+  // The unrolled module of the instruction currently being written.
+  Yosys::RTLIL::IdString currentModName;
+
+  // Finish writing the current instruction's targets, and unless keepModule
+  // is set, remove its unrolled module from the design.
+  void finishInstruction(Yosys::RTLIL::Design *design, bool keepModule);
+
+  // Remove the cached unrollings (the base and the templates) from the
+  // design.  Call this when the flow is done.
+  void purge(Yosys::RTLIL::Design *design);
+};
 
 
 class YosysUFGenerator : public funcExtract::UFGenerator {
@@ -19,14 +80,29 @@ public:
     bool cell_based_llvm_value_names = false;
     bool simplify_and_or_gates = true;
     bool simplify_muxes = true;
+    bool plan_concat = true;
+    bool branch_facts = true;
     bool use_poison = false;
     bool support_pmux = false;
     bool support_hierarchy = false;
     bool optimize_muxes = false;
     int optimize_mux_threshold = -1;
+    bool coi_unroll = false;
+    bool fold_constants = false;
+    bool time_frame = false;
+    bool step_loop = false;
+    bool multi_target = false;
+    bool fused_update = false;
+    int threads = 1;
+    bool bitcode = false;
+    std::string opt_pipeline;
+    bool emit_object = false;
+    bool jit = false;
+    bool state_struct_abi = false;
   };
 
-  YosysUFGenerator(Yosys::RTLIL::Module *srcmod, const Options& opts);
+  YosysUFGenerator(Yosys::RTLIL::Module *srcmod, const Options& opts,
+                   std::shared_ptr<UnrollCache> unrollCache);
   YosysUFGenerator() = delete;
   ~YosysUFGenerator();
 
@@ -46,6 +122,17 @@ private:
                           const funcExtract::InstEncoding_t& encoding, int cycles,
                           Yosys::pool<Yosys::RTLIL::Wire*>& processedPorts);
 
+  Yosys::RTLIL::Module *makeRawUnrolledModule(Yosys::RTLIL::IdString unrolledModName,
+                                       Yosys::RTLIL::Module *srcmod, int num_cycles);
+
+  Yosys::RTLIL::Module *getUnrollTemplate(Yosys::RTLIL::Module *srcmod, int num_cycles);
+
+  void prepareUnrolledModule(Yosys::RTLIL::Module *unrolledMod, int num_cycles);
+
+  void getUnrollConstants(funcExtract::InstrInfo_t& instrInfo, int num_cycles,
+                          std::vector<Yosys::dict<Yosys::RTLIL::IdString,
+                                                  Yosys::RTLIL::Const>>& constInputs);
+
   Yosys::RTLIL::Module *makeUnrolledModule(Yosys::RTLIL::IdString unrolledModName,
                                     Yosys::RTLIL::Module *srcmod,
                                     funcExtract::InstrInfo_t& instrInfo, int num_cycles);
@@ -54,6 +141,7 @@ private:
   Yosys::RTLIL::Design *m_des;
   Yosys::RTLIL::Module *m_srcmod;
   Options m_opts;
+  std::shared_ptr<UnrollCache> m_unrollCache;
 
 };
 
@@ -64,17 +152,27 @@ class YosysUFGenFactory : public funcExtract::UFGenFactory {
 public:
   YosysUFGenFactory(Yosys::RTLIL::Module *srcmod,
                     const YosysUFGenerator::Options& opts) :
-      m_srcmod(srcmod), m_opts(opts) {}
+      m_srcmod(srcmod), m_opts(opts), m_unrollCache(std::make_shared<UnrollCache>()) {}
 
   std::shared_ptr<funcExtract::UFGenerator> makeGenerator() override
   {
     return std::shared_ptr<funcExtract::UFGenerator>(
-        new YosysUFGenerator(m_srcmod, m_opts));
+        new YosysUFGenerator(m_srcmod, m_opts, m_unrollCache));
+  }
+
+  // Call this when the flow is done, to write out any remaining data.
+  // The JIT's func_extract_eval needs the unrolled modules, so with -jit
+  // they are kept.
+  void finish()
+  {
+    m_unrollCache->finishInstruction(m_srcmod->design, m_opts.jit);
+    m_unrollCache->purge(m_srcmod->design);
   }
 
 private:
   Yosys::RTLIL::Module *m_srcmod;
   YosysUFGenerator::Options m_opts;
+  std::shared_ptr<UnrollCache> m_unrollCache;
 };
 
 
@@ -263,8 +263,13 @@ void map_sigspec(const dict<RTLIL::Wire*, RTLIL::Wire*> &map, RTLIL::SigSpec &si
 
 // Copy the src module's objects into the dest module, renaming them
 // based on the given cycle number.  The given RegDict will be filled in.
+// If coi is given, only the cells, wires and connections it lists are copied.
+// If folded is given, the cells in it are not copied: instead their Y outputs
+// are connected to the given (constant or pass-through) values.
 void smash_module(RTLIL::Module *dest, RTLIL::Module *src, 
-                  int cycle, RegDict& registers)
+                  int cycle, RegDict& registers,
+                  const UnrollCoiCycle *coi = nullptr,
+                  const SigSpecDict *folded = nullptr)
 {
   RTLIL::Design *design = dest->design;
   log_assert(src->design == design);
@@ -283,6 +288,9 @@ void smash_module(RTLIL::Module *dest, RTLIL::Module *src,
 
   dict<RTLIL::Wire*, RTLIL::Wire*> wire_map;
   for (auto src_wire : src->wires()) {
+    if (coi && !coi->wires.count(src_wire)) {
+      continue;
+    }
 
     // new_wire inherits the port status of src_wire
     RTLIL::Wire *new_wire = dest->addWire(map_name(dest, src_wire, cycle), src_wire);
@@ -308,6 +316,31 @@ void smash_module(RTLIL::Module *dest, RTLIL::Module *src,
   log_debug("Smashed wires and processes for cycle %d\n", cycle);
 
   for (auto src_cell : src->cells()) {
+    if (coi && !coi->cells.count(src_cell)) {
+      continue;
+    }
+
+    if (folded && folded->count(src_cell)) {
+      // Connect the cell's output to its folded value, unless that refers to
+      // wires that were not copied.
+      RTLIL::SigSpec sig_y = src_cell->getPort(ID::Y);
+      RTLIL::SigSpec value = folded->at(src_cell);
+      bool mappable = !sig_y.has_const();
+      for (auto &chunk : sig_y.chunks()) {
+        if (chunk.wire && !wire_map.count(chunk.wire)) mappable = false;
+      }
+      for (auto &chunk : value.chunks()) {
+        if (chunk.wire && !wire_map.count(chunk.wire)) mappable = false;
+      }
+
+      if (mappable) {
+        map_sigspec(wire_map, sig_y);
+        map_sigspec(wire_map, value);
+        dest->connect(sig_y, value);
+        continue;
+      }
+    }
+
     RTLIL::Cell *new_cell = dest->addCell(map_name(dest, src_cell, cycle), src_cell);
     map_attributes(new_cell, src_cell->name);
     if (new_cell->has_memid()) {
@@ -347,7 +380,13 @@ void smash_module(RTLIL::Module *dest, RTLIL::Module *src,
   // Give the new ports proper port IDs.  (Could be done once, after all cycles are smashed?)
   dest->fixup_ports();
 
+  int conn_idx = -1;
   for (auto &src_conn_it : src->connections()) {
+    ++conn_idx;
+    if (coi && !coi->connections.at(conn_idx)) {
+      continue;
+    }
+
     RTLIL::SigSig new_conn = src_conn_it;
     map_sigspec(wire_map, new_conn.first);
     map_sigspec(wire_map, new_conn.second);
@@ -845,123 +884,657 @@ void join_sigs(RTLIL::Module *destmod,
 
 
 
-void unroll_module(RTLIL::Module *srcmod, RTLIL::Module *destmod, int num_cycles)
+// Constant-folds the combinational cells of a source module for one cycle of
+// an unrolling, given the signal bits that are known to be constant in that
+// cycle.  A cell is folded if all its inputs are constant, or if it is a mux
+// whose select input is constant (in which case its output is a copy of one
+// of its data inputs).  Only 0/1 values are propagated, never x.
+
+struct CycleConstFolder {
+
+  CycleConstFolder(RTLIL::Module *mod) : srcmod(mod), sigmap(mod)
+  {
+    for (auto cell : srcmod->cells()) {
+      for (auto &conn : cell->connections()) {
+        if (cell->output(conn.first)) {
+          for (auto bit : sigmap(conn.second)) {
+            if (bit.wire) {
+              bit_drivers[bit] = cell;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Start a new cycle.  The given constants are the values of named srcmod
+  // wires, and of (sigmapped) register Q bits.
+  void start_cycle(const dict<RTLIL::IdString, RTLIL::Const>& wire_values,
+                   const dict<RTLIL::SigBit, RTLIL::State>& q_values)
+  {
+    values.clear();
+    visited.clear();
+    folded.clear();
+
+    for (auto &it : wire_values) {
+      RTLIL::Wire *wire = srcmod->wire(it.first);
+      if (!wire) {
+        log_warning("Cannot find signal %s to apply a constant to\n", id2cstr(it.first));
+        continue;
+      }
+      for (int i = 0; i < wire->width && i < GetSize(it.second); ++i) {
+        RTLIL::SigBit bit = sigmap(RTLIL::SigBit(wire, i));
+        // Only primary inputs and register outputs can be given values.
+        if (!wire->port_input && !is_ff_output(bit)) {
+          continue;
+        }
+        if (it.second[i] == RTLIL::State::S0 || it.second[i] == RTLIL::State::S1) {
+          values[bit] = it.second[i];
+        }
+      }
+    }
+
+    for (auto &it : q_values) {
+      values[it.first] = it.second;
+    }
+  }
+
+  void fold_all()
+  {
+    for (auto cell : srcmod->cells()) {
+      fold_cell(cell);
+    }
+  }
+
+  // Compute which register Q bits will be constant in the next cycle.
+  // Call this after fold_all().
+  void next_q_values(dict<RTLIL::SigBit, RTLIL::State>& q_values)
+  {
+    q_values.clear();
+
+    for (auto cell : srcmod->cells()) {
+      if (RTLIL::builtin_ff_cell_types().count(cell->type) == 0) {
+        continue;
+      }
+      FfData ff(nullptr, cell);
+      if (ff.has_gclk || !ff.has_clk || ff.has_sr || ff.has_arst || ff.has_aload) {
+        continue;  // split_ff() will complain about these
+      }
+
+      // Figure out which of D, Q, or the reset value will be loaded.
+      RTLIL::State en = RTLIL::State::S1;
+      RTLIL::State rst = RTLIL::State::S0;
+      if (ff.has_ce) {
+        RTLIL::SigBit ce = resolve(RTLIL::SigBit(ff.sig_ce));
+        if (ce.wire) continue;
+        en = (ce.data == (ff.pol_ce ? RTLIL::State::S1 : RTLIL::State::S0)) ?
+                  RTLIL::State::S1 : RTLIL::State::S0;
+      }
+      if (ff.has_srst) {
+        RTLIL::SigBit srst = resolve(RTLIL::SigBit(ff.sig_srst));
+        if (srst.wire) continue;
+        rst = (srst.data == (ff.pol_srst ? RTLIL::State::S1 : RTLIL::State::S0)) ?
+                  RTLIL::State::S1 : RTLIL::State::S0;
+      }
+
+      RTLIL::SigSpec next;
+      if (rst == RTLIL::State::S1 && (!ff.ce_over_srst || en == RTLIL::State::S1)) {
+        next = ff.val_srst;
+      } else if (en == RTLIL::State::S1) {
+        next = resolve(ff.sig_d);
+      } else {
+        next = resolve(ff.sig_q);
+      }
+
+      for (int i = 0; i < ff.width; ++i) {
+        if (next[i] == RTLIL::State::S0 || next[i] == RTLIL::State::S1) {
+          q_values[sigmap(ff.sig_q[i])] = next[i].data;
+        }
+      }
+    }
+  }
+
+  RTLIL::Module *srcmod;
+  SigMap sigmap;
+
+  // The cell driving each sigmapped bit.
+  dict<RTLIL::SigBit, RTLIL::Cell*> bit_drivers;
+
+  // For the current cycle: the value of each sigmapped bit that is known to
+  // be constant or to be a copy of some other (sigmapped) bit.
+  dict<RTLIL::SigBit, RTLIL::SigBit> values;
+  pool<RTLIL::Cell*> visited;
+
+  // For the current cycle: the folded cells, and the values of their Y outputs.
+  SigSpecDict folded;
+
+  // The number of cells folded over all cycles.
+  int total_folded = 0;
+
+private:
+
+  bool is_ff_output(const RTLIL::SigBit& bit)
+  {
+    auto it = bit_drivers.find(bit);
+    return it != bit_drivers.end() &&
+           RTLIL::builtin_ff_cell_types().count(it->second->type) > 0;
+  }
+
+  RTLIL::SigBit resolve(RTLIL::SigBit bit)
+  {
+    if (!bit.wire) {
+      return bit;
+    }
+    bit = sigmap(bit);
+
+    auto it = values.find(bit);
+    if (it == values.end()) {
+      auto driver = bit_drivers.find(bit);
+      if (driver != bit_drivers.end() && !visited.count(driver->second)) {
+        fold_cell(driver->second);
+        it = values.find(bit);
+      }
+    }
+
+    return (it == values.end()) ? bit : it->second;
+  }
+
+  RTLIL::SigSpec resolve(const RTLIL::SigSpec& sig)
+  {
+    RTLIL::SigSpec result;
+    for (auto bit : sig) {
+      result.append(resolve(bit));
+    }
+    return result;
+  }
+
+  void fold_cell(RTLIL::Cell *cell)
+  {
+    if (visited.count(cell)) {
+      return;
+    }
+    visited.insert(cell);
+
+    if (!yosys_celltypes.cell_evaluable(cell->type) || !cell->hasPort(ID::Y)) {
+      return;
+    }
+
+    RTLIL::SigSpec sig_y = cell->getPort(ID::Y);
+    RTLIL::SigSpec value;
+
+    if (cell->type.in(ID($mux), ID($_MUX_))) {
+      RTLIL::SigBit s = resolve(cell->getPort(ID::S).as_bit());
+      if (s == RTLIL::State::S0) {
+        value = resolve(cell->getPort(ID::A));
+      } else if (s == RTLIL::State::S1) {
+        value = resolve(cell->getPort(ID::B));
+      } else {
+        return;
+      }
+
+    } else if (cell->type == ID($pmux)) {
+      RTLIL::SigSpec s = resolve(cell->getPort(ID::S));
+      if (!s.is_fully_def()) {
+        return;
+      }
+      int width = cell->getParam(ID::WIDTH).as_int();
+      int hot = -1;
+      for (int i = 0; i < GetSize(s); ++i) {
+        if (s[i] == RTLIL::State::S1) {
+          if (hot >= 0) return;  // Not one-hot
+          hot = i;
+        }
+      }
+      if (hot < 0) {
+        value = resolve(cell->getPort(ID::A));
+      } else {
+        value = resolve(cell->getPort(ID::B).extract(hot*width, width));
+      }
+
+    } else {
+      // Plain unary and binary cells
+      for (auto &conn : cell->connections()) {
+        if (cell->input(conn.first) && conn.first != ID::A && conn.first != ID::B) {
+          return;
+        }
+      }
+      RTLIL::SigSpec a = resolve(cell->getPort(ID::A));
+      RTLIL::SigSpec b = cell->hasPort(ID::B) ? resolve(cell->getPort(ID::B)) : RTLIL::SigSpec();
+      if (!a.is_fully_def() || !b.is_fully_def()) {
+        return;
+      }
+
+      bool err = false;
+      RTLIL::Const y = CellTypes::eval(cell, a.as_const(), b.as_const(), &err);
+      if (err || !y.is_fully_def()) {
+        return;
+      }
+      value = y;
+    }
+
+    if (value.size() != sig_y.size()) {
+      return;
+    }
+
+    folded[cell] = value;
+    for (int i = 0; i < sig_y.size(); ++i) {
+      if (sig_y[i].wire) {
+        values[sigmap(sig_y[i])] = value[i];
+      }
+    }
+  }
+};
+
+
+
+// Smash one more cycle onto the dest module of the given UnrollState, and
+// connect its registers to the to_D signals of the previous cycle.  The
+// state's to_Ds are updated to the new cycle's to_D signals.  If a folder is
+// given, constant cells are folded away as they are smashed.
+
+static void smash_next_cycle(UnrollState& state, CycleConstFolder *folder)
 {
+    RTLIL::Module *destmod = state.destmod;
+    int cycle = ++state.cycles;
+
+    RegDict cur_cycle_regs;
+
+    if (folder) {
+      folder->start_cycle(state.const_inputs.at(cycle), state.const_q);
+      folder->fold_all();
+      log_debug("Folded %d cells for cycle %d\n", GetSize(folder->folded), cycle);
+      folder->total_folded += GetSize(folder->folded);
+    }
+
+    smash_module(destmod, state.srcmod, cycle, cur_cycle_regs,
+                 state.coi.empty() ? nullptr : &state.coi.at(cycle),
+                 folder ? &folder->folded : nullptr);
+
+    if (folder) {
+      folder->next_q_values(state.const_q);
+    }
+
+    SigSpecDict cur_cycle_to_Ds;
+
+    for (auto pair : cur_cycle_regs) {
+      RTLIL::Cell *orig_reg = pair.first;
+      RTLIL::Cell *cycle_reg = pair.second;
+
+      // This sets to_D and from_Q
+      RTLIL::SigSpec to_D;
+      RTLIL::SigSpec from_Q;
+      if (orig_reg->is_mem_cell()) {
+        split_mem(cycle_reg, orig_reg, cycle, to_D, from_Q);
+      } else {
+        split_ff(cycle_reg, to_D, from_Q);
+      }
+
+      cur_cycle_to_Ds[orig_reg] = to_D;
+
+      if (cycle == 1) {
+        // Make the starting cycle's from_Q signal an input port.
+        // These ports are where initial ASV values or reset values will
+        // be fed into the circuit.
+        // If the sigspec specifies more than one wire, things are tricky.
+        // To fix that, we may need to add an extra wire.
+        // TODO: the port needs to have a hdlname attribute or something
+        // similar to identify the  original Verilog register.  The wire name
+        // is not always helpful for this.
+        // BTW, the ports for non-ASVs will typically get a constant reset value
+        // put on them and get un-ported, and will get optimized away.
+        log_debug("first cycle input signal: ");
+        my_log_debug_sigspec(from_Q);
+
+        // TODO: How to supply reset value?  Observed case: one wide
+        // signal feeds several FFs.  So for slices, make the entire wire an
+        // input port.
+
+        RTLIL::Wire *initialPort = nullptr;
+        if (from_Q.is_wire()) {
+          initialPort = from_Q.as_wire();
+        } else if (from_Q.is_chunk() && from_Q.as_chunk().is_wire()) {
+          initialPort = from_Q.as_chunk().wire;
+          log_warning("Initial cycle Q signal is a slice of a wire!\n");
+          my_log_sigspec(from_Q);
+        } else if (from_Q.empty()) {
+          log_warning("Initial cycle Q signal is unconnected!\n");
+        } else if (from_Q.is_fully_const()) {
+          log_warning("Initial cycle Q signal is constant!\n");
+        } else {
+          log_warning("Initial cycle Q signal is complicated:\n");
+          my_log_sigspec(from_Q);
+          // I have observed a case where from_Q was a complex subset of a wire's bits.
+          for (auto chunk : from_Q.chunks()) {
+            if (chunk.is_wire()) {
+              chunk.wire->port_input = true;
+            }
+          }
+        }
+
+        if (initialPort) {
+          initialPort->port_input = true;
+          log_debug("First cycle input port %s\n", initialPort->name.c_str());
+        }
+      }
+
+      if (cycle > 1) {
+        // Connect the previous cycle's to_D (driver) signal to the current
+        // cycle's from_Q (load) signal.
+        // Remember: the previously-created cycle is the previous cycle in time!
+        // The cycles are numbered forwards in time.
+        // In a pruned unrolling, a register that is present only for the
+        // sake of its D value may be absent from the previous cycle.
+        auto it = state.to_Ds.find(orig_reg);
+        if (it != state.to_Ds.end()) {
+          join_sigs(destmod, it->second, from_Q);
+        } else {
+          log_assert(!state.coi.empty());
+        }
+      }
+
+      // The from_Q signals of the final cycle (num_cycles+1) may be
+      // turned into ports by the caller, but only for signals representing
+      // ASVs.  Non-ASV from_Q signals (and their fanout) are generally
+      // useless, and will get optimized away.
+
+    }
+
+    state.to_Ds.swap(cur_cycle_to_Ds);
+}
+
+
+
+// Smash cycles onto state.destmod until it holds num_cycles+1 cycles.  If
+// the state is fresh, the unrolling starts from scratch.  Otherwise the
+// new cycles are added after the ones that were smashed by earlier calls,
+// so an N-cycle unrolling can be cheaply extended to N+1 cycles.  Of course
+// this only works if nothing (e.g. instruction encodings or optimization)
+// has been applied to state.destmod in the meantime.
+
+void extend_unrolled_module(UnrollState& state, int num_cycles)
+{
+    log_assert(state.srcmod && state.destmod);
+    log_assert(state.cycles <= num_cycles+1);
+    log_assert(state.coi.empty() || (int)state.coi.size() == num_cycles+2);
+
     auto_prefix = "";
     auto_name_map.clear();
 
-    makeMemoryAccessModules(destmod->design);
+    if (state.cycles == 0) {
+      makeMemoryAccessModules(state.destmod->design);
 
-    // Copy the source module's attributes to it.
-    for (auto &attr : srcmod->attributes) {
-      destmod->attributes[attr.first] = attr.second;
+      // Copy the source module's attributes to it.
+      for (auto &attr : state.srcmod->attributes) {
+        state.destmod->attributes[attr.first] = attr.second;
+      }
     }
 
-    SigSpecDict to_Ds0;
-    SigSpecDict to_Ds1;
-
     // We unroll forwards in time, and (unlike the original
     // func_extract program) the cycles are numbered forwards in time.
     // The data flow is from cycle 1 to cycle <num_cycles+1>,
     // Ultimately the current ASV values will be fed into the
     // input ports associated with cycle 1, and the new ASV value
     // will be available at an output port associated with cycle <num_cycles+1>.
-    for (int cycle = 1; cycle <= num_cycles+1; ++cycle) {
+    std::unique_ptr<CycleConstFolder> folder;
+    if (!state.const_inputs.empty()) {
+      log_assert((int)state.const_inputs.size() == num_cycles+2);
+      folder.reset(new CycleConstFolder(state.srcmod));
+    }
 
-      RegDict cur_cycle_regs;
+    while (state.cycles < num_cycles+1) {
+      smash_next_cycle(state, folder.get());
+    }
 
-      smash_module(destmod, srcmod, cycle, cur_cycle_regs);
+    if (folder) {
+      log("Constant folding: folded %d cells while unrolling\n", folder->total_folded);
+    }
 
-      // For efficiency we use a pair of SigSpecDicts, which alternate 
-      // between the roles of 'current' and 'prev'.
-      SigSpecDict& prev_cycle_to_Ds = (cycle&0x01) ? to_Ds0 : to_Ds1;
-      SigSpecDict& cur_cycle_to_Ds = (cycle&0x01) ? to_Ds1 : to_Ds0;
+    state.destmod->fixup_ports();
 
-      cur_cycle_to_Ds.clear();
+    auto_name_map.clear();
+}
 
-      for (auto pair : cur_cycle_regs) {
-        RTLIL::Cell *orig_reg = pair.first;
-        RTLIL::Cell *cycle_reg = pair.second;
 
-        // This sets to_D and from_Q
-        RTLIL::SigSpec to_D;
-        RTLIL::SigSpec from_Q;
-        if (orig_reg->is_mem_cell()) {
-          split_mem(cycle_reg, orig_reg, cycle, to_D, from_Q);
-        } else {
-          split_ff(cycle_reg, to_D, from_Q);
+
+// Compute the cone of influence of the given target signals over an
+// unrolling of num_cycles+1 cycles, and store it in state.coi.  Working
+// backwards from the final cycle, each cycle gets the registers whose Q values
+// are needed in that cycle or whose D values are needed in the following
+// cycle, plus the combinational logic that feeds those D values.  A target is
+// a wire driven by registers, or a memory.
+
+void compute_unroll_coi(UnrollState& state, const pool<RTLIL::IdString>& targets, int num_cycles)
+{
+    RTLIL::Module *srcmod = state.srcmod;
+    log_assert(state.cycles == 0);
+
+    // Processes are not modeled here, and should have been removed by now.
+    if (!srcmod->processes.empty()) {
+      log_error("Module %s contains processes, cannot compute its cone of influence\n",
+                id2cstr(srcmod->name));
+    }
+
+    SigMap sigmap(srcmod);
+
+    auto is_reg = [](RTLIL::Cell *cell) {
+      return RTLIL::builtin_ff_cell_types().count(cell->type) > 0 || cell->is_mem_cell();
+    };
+
+    // Map each signal bit to the cell that drives it.
+    dict<RTLIL::SigBit, RTLIL::Cell*> bit_drivers;
+    for (auto cell : srcmod->cells()) {
+      for (auto &conn : cell->connections()) {
+        if (cell->output(conn.first)) {
+          for (auto bit : sigmap(conn.second)) {
+            if (bit.wire) {
+              bit_drivers[bit] = cell;
+            }
+          }
         }
+      }
+    }
 
-        cur_cycle_to_Ds[orig_reg] = to_D;
-
-        RTLIL::SigSpec& prev_cycle_to_D = prev_cycle_to_Ds[orig_reg];
-
-
-        if (cycle == 1) {
-          // Make the starting cycle's from_Q signal an input port.
-          // These ports are where initial ASV values or reset values will
-          // be fed into the circuit.
-          // If the sigspec specifies more than one wire, things are tricky.
-          // To fix that, we may need to add an extra wire.
-          // TODO: the port needs to have a hdlname attribute or something
-          // similar to identify the  original Verilog register.  The wire name
-          // is not always helpful for this.
-          // BTW, the ports for non-ASVs will typically get a constant reset value
-          // put on them and get un-ported, and will get optimized away.
-          log_debug("first cycle input signal: ");
-          my_log_debug_sigspec(from_Q);
-
-          // TODO: How to supply reset value?  Observed case: one wide
-          // signal feeds several FFs.  So for slices, make the entire wire an
-          // input port.
-
-          RTLIL::Wire *initialPort = nullptr;
-          if (from_Q.is_wire()) {
-            initialPort = from_Q.as_wire();
-          } else if (from_Q.is_chunk() && from_Q.as_chunk().is_wire()) {
-            initialPort = from_Q.as_chunk().wire;
-            log_warning("Initial cycle Q signal is a slice of a wire!\n");
-            my_log_sigspec(from_Q);
-          } else if (from_Q.empty()) {
-            log_warning("Initial cycle Q signal is unconnected!\n");
-          } else if (from_Q.is_fully_const()) {
-            log_warning("Initial cycle Q signal is constant!\n");
-          } else {
-            log_warning("Initial cycle Q signal is complicated:\n");
-            my_log_sigspec(from_Q);
-            // I have observed a case where from_Q was a complex subset of a wire's bits.
-            for (auto chunk : from_Q.chunks()) {
-              if (chunk.is_wire()) {
-                chunk.wire->port_input = true;
-              }
+    // Clock inputs are ignored, since they are dead in the unrolled design.
+    auto push_inputs = [&](RTLIL::Cell *cell, std::vector<RTLIL::SigBit>& worklist) {
+      for (auto &conn : cell->connections()) {
+        if (cell->input(conn.first) && conn.first != ID::CLK) {
+          for (auto bit : sigmap(conn.second)) {
+            if (bit.wire) {
+              worklist.push_back(bit);
             }
           }
+        }
+      }
+    };
+
+    // Registers whose Q values are needed in the current cycle, and in the
+    // following cycle.
+    pool<RTLIL::Cell*> need_q;
+    pool<RTLIL::Cell*> next_need_q;
+
+    for (auto &name : targets) {
+      RTLIL::Wire *wire = srcmod->wire(name);
+      RTLIL::Cell *mem = srcmod->cell(name);
+      if (wire) {
+        for (auto bit : sigmap(wire)) {
+          auto it = bit_drivers.find(bit);
+          if (it != bit_drivers.end() && is_reg(it->second)) {
+            need_q.insert(it->second);
+          }
+        }
+      } else if (mem && mem->is_mem_cell()) {
+        need_q.insert(mem);
+      } else {
+        log_warning("Cannot find target signal %s in module %s\n",
+                    id2cstr(name), id2cstr(srcmod->name));
+      }
+    }
+
+    // Always keep the target registers in the first cycle, so that the
+    // first-cycle ASV ports exist even if the ASV does not affect itself.
+    pool<RTLIL::Cell*> target_regs = need_q;
+
+    state.coi.clear();
+    state.coi.resize(num_cycles+2);
+
+    int num_kept = 0;
+
+    for (int cycle = num_cycles+1; cycle >= 1; --cycle) {
+      UnrollCoiCycle& coi = state.coi[cycle];
+      std::vector<RTLIL::SigBit> worklist;
+
+      // Start from the D sides of the registers needed in the following
+      // cycle.  Registers with an enable, and memories, also feed back their
+      // Q values.
+      for (auto reg : next_need_q) {
+        coi.cells.insert(reg);
+        push_inputs(reg, worklist);
+        if (reg->is_mem_cell() || FfData(nullptr, reg).has_ce) {
+          need_q.insert(reg);
+        }
+      }
 
-          if (initialPort) {
-            initialPort->port_input = true;
-            log_debug("First cycle input port %s\n", initialPort->name.c_str());
+      pool<RTLIL::Cell*> visited;
+      while (!worklist.empty()) {
+        RTLIL::SigBit bit = worklist.back();
+        worklist.pop_back();
+
+        auto it = bit_drivers.find(bit);
+        if (it == bit_drivers.end() || visited.count(it->second)) {
+          continue;
+        }
+        RTLIL::Cell *driver = it->second;
+        visited.insert(driver);
+
+        if (is_reg(driver)) {
+          need_q.insert(driver);
+          // A memory's read data depends on its read address in the same cycle.
+          if (driver->is_mem_cell()) {
+            push_inputs(driver, worklist);
+          }
+        } else {
+          coi.cells.insert(driver);
+          push_inputs(driver, worklist);
+        }
+      }
+
+      for (auto reg : need_q) {
+        coi.cells.insert(reg);
+      }
+      if (cycle == 1) {
+        for (auto reg : target_regs) {
+          coi.cells.insert(reg);
+        }
+      }
+
+      // Keep every wire that shares a signal with a kept cell, or that a
+      // kept cell names directly (which it may do even if the wire's value
+      // is a constant).  Input ports are always kept, since the instruction
+      // encodings get applied to them.  Output ports outside the cone are
+      // dropped, rather than left undriven.
+      pool<RTLIL::SigBit> bits;
+      pool<RTLIL::Wire*> named;
+      for (auto cell : coi.cells) {
+        for (auto &conn : cell->connections()) {
+          for (auto bit : sigmap(conn.second)) {
+            if (bit.wire) {
+              bits.insert(bit);
+            }
+          }
+          for (auto &chunk : conn.second.chunks()) {
+            if (chunk.wire) named.insert(chunk.wire);
           }
         }
+      }
+      coi.wires = named;
 
-        if (cycle > 1) {
-          // Connect the previous cycle's to_D (driver) signal to the current
-          // cycle's from_Q (load) signal.
-          // Remember: the previously-created cycle is the previous cycle in time!
-          // The cycles are numbered forwards in time.
-          join_sigs(destmod, prev_cycle_to_D, from_Q);
+      for (auto wire : srcmod->wires()) {
+        if (wire->port_input) {
+          coi.wires.insert(wire);
+          continue;
+        }
+        for (auto bit : sigmap(wire)) {
+          if (bits.count(bit)) {
+            coi.wires.insert(wire);
+            break;
+          }
         }
+      }
 
-        // The from_Q signals of the final cycle (num_cycles+1) may be
-        // turned into ports by the caller, but only for signals representing
-        // ASVs.  Non-ASV from_Q signals (and their fanout) are generally
-        // useless, and will get optimized away.
+      // Keep the connections of kept signals and of directly named wires,
+      // along with the wires they name.  A wire kept only because it is named
+      // directly gets its value through connections which may name further
+      // wires, so repeat until no more are kept.
+      coi.connections.assign(srcmod->connections().size(), false);
+      bool changed = true;
+      while (changed) {
+        changed = false;
+        int idx = -1;
+        for (auto &conn : srcmod->connections()) {
+          ++idx;
+          if (coi.connections[idx]) {
+            continue;
+          }
 
+          bool keep = false;
+          for (auto bit : sigmap(conn.first)) {
+            if (bit.wire && bits.count(bit)) {
+              keep = true;
+              break;
+            }
+          }
+          for (auto sig : {&conn.first, &conn.second}) {
+            for (auto &chunk : sig->chunks()) {
+              if (chunk.wire && named.count(chunk.wire)) keep = true;
+            }
+          }
+          if (!keep) {
+            continue;
+          }
+
+          coi.connections[idx] = true;
+          changed = true;
+          for (auto sig : {&conn.first, &conn.second}) {
+            for (auto &chunk : sig->chunks()) {
+              if (chunk.wire) {
+                named.insert(chunk.wire);
+                coi.wires.insert(chunk.wire);
+              }
+            }
+          }
+        }
       }
+
+      log_debug("Cycle %d cone of influence: %d cells, %d wires\n",
+                cycle, GetSize(coi.cells), GetSize(coi.wires));
+      num_kept += GetSize(coi.cells);
+
+      next_need_q.swap(need_q);
+      need_q.clear();
     }
 
-    destmod->fixup_ports();
+    log("Cone of influence: unrolling %d of %d cells\n",
+        num_kept, GetSize(srcmod->cells()) * (num_cycles+1));
+}
 
-    auto_name_map.clear();
+
+
+void unroll_module(RTLIL::Module *srcmod, RTLIL::Module *destmod, int num_cycles,
+                   const pool<RTLIL::IdString> *coi_targets,
+                   const std::vector<dict<RTLIL::IdString, RTLIL::Const>> *const_inputs)
+{
+    UnrollState state;
+    state.srcmod = srcmod;
+    state.destmod = destmod;
+    if (const_inputs) {
+      state.const_inputs = *const_inputs;
+    }
+
+    if (coi_targets) {
+      compute_unroll_coi(state, *coi_targets, num_cycles);
+    }
+
+    extend_unrolled_module(state, num_cycles);
 }
 
 
@@ -3,6 +3,58 @@
 
 #include "kernel/yosys.h"
 
-void unroll_module(Yosys::RTLIL::Module *srcmod, Yosys::RTLIL::Module *destmod, int num_cycles);
+
+// The parts of the source module that must be smashed into one cycle of an
+// unrolling that is pruned to the cone of influence of some target signals.
+struct UnrollCoiCycle {
+  Yosys::pool<Yosys::RTLIL::Cell*> cells;
+  Yosys::pool<Yosys::RTLIL::Wire*> wires;
+
+  // Indexed the same as srcmod->connections()
+  std::vector<bool> connections;
+};
+
+
+// The progress of an unrolling of srcmod into destmod.  Keeping this around
+// allows more cycles to be smashed onto destmod later.
+struct UnrollState {
+  Yosys::RTLIL::Module *srcmod = nullptr;
+  Yosys::RTLIL::Module *destmod = nullptr;
+
+  // The number of cycles smashed into destmod so far.
+  int cycles = 0;
+
+  // Maps each register or memory of srcmod to the signal in destmod that
+  // drives its D pin in the most recently smashed cycle.
+  Yosys::dict<Yosys::RTLIL::Cell*, Yosys::RTLIL::SigSpec> to_Ds;
+
+  // If not empty, only these parts of srcmod are smashed.  Indexed by cycle.
+  std::vector<UnrollCoiCycle> coi;
+
+  // If not empty, the constant values of srcmod input ports (and of register
+  // outputs, for cycle 1) in each cycle.  Cells that these make constant are
+  // folded away while smashing.  Indexed by cycle.
+  std::vector<Yosys::dict<Yosys::RTLIL::IdString, Yosys::RTLIL::Const>> const_inputs;
+
+  // The register output bits known to be constant in the next cycle to be
+  // smashed.  Only used if const_inputs is given.
+  Yosys::dict<Yosys::RTLIL::SigBit, Yosys::RTLIL::State> const_q;
+};
+
+
+// If coi_targets is given, only the cone of influence of the final-cycle
+// values of those signals (wire or memory names in srcmod) is unrolled.
+// If const_inputs is given, it becomes the UnrollState's const_inputs.
+void unroll_module(Yosys::RTLIL::Module *srcmod, Yosys::RTLIL::Module *destmod, int num_cycles,
+                   const Yosys::pool<Yosys::RTLIL::IdString> *coi_targets = nullptr,
+                   const std::vector<Yosys::dict<Yosys::RTLIL::IdString,
+                                                 Yosys::RTLIL::Const>> *const_inputs = nullptr);
+
+// Fill in state.coi for an unrolling of num_cycles+1 cycles.
+void compute_unroll_coi(UnrollState& state, const Yosys::pool<Yosys::RTLIL::IdString>& targets,
+                        int num_cycles);
+
+// Smash more cycles onto state.destmod until it holds num_cycles+1 cycles.
+void extend_unrolled_module(UnrollState& state, int num_cycles);
 
 #endif
@@ -20,12 +20,31 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/ValueSymbolTable.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 
 // Yosys headers
 #include "kernel/yosys.h"
 #include "kernel/sigtools.h"
+#include "kernel/ff.h"
 #include "backends/rtlil/rtlil_backend.h"
 
+#include <exception>
+#include <mutex>
+
+// Switching generateValue() to stack segments needs the ucontext functions
+// and pthread_getattr_np(), which only glibc is known to provide.  Elsewhere
+// it is plain recursion, limited by the thread's stack.
+#if defined(__GLIBC__)
+#define USE_STACK_SEGMENTS 1
+#include <pthread.h>
+#include <ucontext.h>
+#endif
+
 
 // Unfortunately including func_extract/src/util.h triggers the nasty "#define ID" issue.
 namespace funcExtract {
@@ -35,9 +54,15 @@ namespace funcExtract {
   constexpr const char *RETURN_ARRAY_PTR_ID = "*RETURN_ARRAY_PTR*";  
 }
 
+// With -state_struct_abi, the name of the arg that points to the state
+// struct, and the struct's alignment (a cache line).
+static constexpr const char *STATE_STRUCT_PTR_ID = "*STATE_STRUCT_PTR*";
+static constexpr int STATE_STRUCT_ALIGN = 64;
+
 
 #include "util.h"
 #include "driver_tools.h"
+#include "llvm_backend.h"
 
 
 USING_YOSYS_NAMESPACE  // Does "using namespace"
@@ -63,8 +88,14 @@ LLVMWriter::~LLVMWriter()
 void
 LLVMWriter::clearFunctionData()
 {
-  finder.clear();
+  ownFinder.clear();
+  finder = &ownFinder;
   valueCache.clear();
+  stepLoopResults.clear();
+  branchFacts.clear();
+  branchFactObjects.clear();
+  stateFields.clear();
+  stateSize = 0;
   llvmFunc = nullptr; 
 }
 
@@ -209,15 +240,132 @@ LLVMWriter::getWidth(llvm::Type *ty)
 
 
 void
-LLVMWriter::ValueCache::add(const DriverSpec& driver, llvm::Value *value)
+LLVMWriter::ValueCache::clear()
 {
-  // There is no point in putting non-instructions
-  // (e.g. constants or function args) in the cache.
-  llvm::Instruction *instr = llvm::dyn_cast<llvm::Instruction>(value);
-  if (!instr) {
-    return;
+  _slots.clear();
+  _nKeys = 0;
+  _entries.clear();
+  _interned.clear();
+  _cycle = 0;
+  _nHits = 0;
+  _nMisses = 0;
+  _func = nullptr;
+  _DT.reset();
+  _DTBuilt = false;
+  _pendingUpdates.clear();
+}
+
+
+void
+LLVMWriter::ValueCache::insertEdge(llvm::BasicBlock *from, llvm::BasicBlock *to)
+{
+  if (_DTBuilt) {
+    _pendingUpdates.push_back({llvm::DominatorTree::Insert, from, to});
+  }
+}
+
+
+void
+LLVMWriter::ValueCache::deleteEdge(llvm::BasicBlock *from, llvm::BasicBlock *to)
+{
+  if (_DTBuilt) {
+    _pendingUpdates.push_back({llvm::DominatorTree::Delete, from, to});
+  }
+}
+
+
+// The dominator tree, brought up to date with the current CFG.
+llvm::DominatorTree&
+LLVMWriter::ValueCache::domTree()
+{
+  if (!_DTBuilt) {
+    _DT.recalculate(*_func);
+    _DTBuilt = true;
+  } else if (!_pendingUpdates.empty()) {
+    _DT.applyUpdates(_pendingUpdates);
+    _pendingUpdates.clear();
+  }
+  return _DT;
+}
+
+
+LLVMWriter::ValueCache::Key
+LLVMWriter::ValueCache::chunkKey(const DriverChunk& chunk, int destOffset, int totalWidth) const
+{
+  log_assert(chunk.is_object());
+  if (chunk.is_cell()) {
+    return {chunk.cell, chunk.port.index_, chunk.offset, chunk.width, destOffset, totalWidth, _cycle};
+  }
+  return {chunk.wire, 0, chunk.offset, chunk.width, destOffset, totalWidth, _cycle};
+}
+
+
+// Get the key of the given driver.  If it is not a single object slice and
+// has not been interned, intern it if requested, otherwise return false.
+bool
+LLVMWriter::ValueCache::driverKey(const DriverSpec& driver, bool intern, Key& key)
+{
+  if (driver.is_chunk() && driver.chunks()[0].is_object()) {
+    key = chunkKey(driver.chunks()[0], 0, driver.size());
+    return true;
+  }
+
+  auto pos = _interned.find(driver);
+  if (pos == _interned.end()) {
+    if (!intern) {
+      return false;
+    }
+    pos = _interned.insert({driver, (int)_interned.size()}).first;
+  }
+
+  key = {nullptr, pos->second, 0, driver.size(), 0, driver.size(), _cycle};
+  return true;
+}
+
+
+// Return the slot holding the given key, or the empty slot where it
+// belongs.  The table must not be empty.
+LLVMWriter::ValueCache::Slot&
+LLVMWriter::ValueCache::findSlot(const Key& key)
+{
+  uint64_t h = reinterpret_cast<uintptr_t>(key.object);
+  h = (h ^ (h >> 4)) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (unsigned)key.port) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (unsigned)key.offset ^ ((uint64_t)key.width << 32)) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (unsigned)key.destOffset ^ ((uint64_t)key.totalWidth << 32)) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (unsigned)key.cycle) * 0x9e3779b97f4a7c15ULL;
+
+  size_t mask = _slots.size() - 1;
+  for (size_t i = (h >> 32) & mask; ; i = (i + 1) & mask) {
+    Slot& slot = _slots[i];
+    if (slot.head < 0 || slot.key == key) {
+      return slot;
+    }
+  }
+}
+
+
+// Double the size of the table (keeping it at most half full).
+void
+LLVMWriter::ValueCache::grow()
+{
+  std::vector<Slot> oldSlots;
+  oldSlots.swap(_slots);
+  _slots.resize(oldSlots.empty() ? 1024 : 2 * oldSlots.size());
+
+  for (const Slot& slot : oldSlots) {
+    if (slot.head >= 0) {
+      findSlot(slot.key) = slot;
+    }
   }
+}
 
+
+// Add instr under the given key, unless there already is a Value for the
+// key in the same BB, which is returned instead (unless it is instr).
+llvm::Instruction *
+LLVMWriter::ValueCache::addEntry(const Key& key, llvm::Instruction *instr)
+{
   // Grab the Function from the first Instruction we add.
   if (!_func) {
     _func = instr->getFunction();
@@ -225,67 +373,119 @@ LLVMWriter::ValueCache::add(const DriverSpec& driver, llvm::Value *value)
     log_assert(instr->getFunction() == _func);
   }
 
-  // See if we already have an entry for the given driver, in the same BB
-  // equal_range() returns a pair of iterators
-  auto range = _mmap.equal_range(driver);
+  if (2 * (_nKeys + 1) > _slots.size()) {
+    grow();
+  }
 
-  for (auto pos = range.first; pos != range.second; ++pos) {
-    llvm::Instruction *entry =  llvm::dyn_cast<llvm::Instruction>(pos->second);
-    log_assert(entry);
+  Slot& slot = findSlot(key);
+  if (slot.head < 0) {
+    slot.key = key;
+    ++_nKeys;
+  }
 
-    if (entry->getParent() == instr->getParent()) {
-      log_warning("Repeated calculation of Value for driverspec:\n");
-      log_driverspec(driver);
-      log("existing Value %p:\n", entry);
-      entry->dump();
-      log("new Value %p:\n", instr);
-      instr->dump();
-      log_flush();
-      return;
+  for (int e = slot.head; e >= 0; e = _entries[e].next) {
+    if (_entries[e].instr->getParent() == instr->getParent()) {
+      return _entries[e].instr == instr ? nullptr : _entries[e].instr;
     }
   }
 
-  _mmap.insert(MmapType::value_type(driver,value));
+  _entries.push_back({instr, slot.head});
+  slot.head = _entries.size() - 1;
+  return nullptr;
+}
+
+
+static void
+logRepeatedValue(const DriverSpec& driver, llvm::Instruction *entry, llvm::Instruction *instr)
+{
+  log_warning("Repeated calculation of Value for driverspec:\n");
+  log_driverspec(driver);
+  log("existing Value %p:\n", entry);
+  entry->dump();
+  log("new Value %p:\n", instr);
+  instr->dump();
+  log_flush();
+}
+
+
+void
+LLVMWriter::ValueCache::add(const DriverSpec& driver, llvm::Value *value)
+{
+  // There is no point in putting non-instructions
+  // (e.g. constants or function args) in the cache.
+  llvm::Instruction *instr = llvm::dyn_cast<llvm::Instruction>(value);
+  if (!instr) {
+    return;
+  }
+
+  Key key;
+  driverKey(driver, true, key);
+  if (llvm::Instruction *entry = addEntry(key, instr)) {
+    logRepeatedValue(driver, entry, instr);
+  }
+}
+
+
+void
+LLVMWriter::ValueCache::add(const DriverChunk& chunk, llvm::Value *value)
+{
+  llvm::Instruction *instr = llvm::dyn_cast<llvm::Instruction>(value);
+  if (!instr) {
+    return;
+  }
+
+  if (llvm::Instruction *entry = addEntry(chunkKey(chunk, 0, chunk.size()), instr)) {
+    logRepeatedValue(DriverSpec(chunk), entry, instr);
+  }
+}
+
+
+void
+LLVMWriter::ValueCache::addPlaced(const DriverChunk& chunk, int destOffset, int totalWidth,
+                                  llvm::Value *value)
+{
+  llvm::Instruction *instr = llvm::dyn_cast<llvm::Instruction>(value);
+  if (!instr) {
+    return;
+  }
+
+  if (llvm::Instruction *entry = addEntry(chunkKey(chunk, destOffset, totalWidth), instr)) {
+    log("Placed at offset %d of %d bits:\n", destOffset, totalWidth);
+    logRepeatedValue(DriverSpec(chunk), entry, instr);
+  }
 }
 
 
-// If bb is non-null, this will look for a cached driver in the same BB, or
-// in a BB that dominates the given BB.
 llvm::Value *
-LLVMWriter::ValueCache::find(const DriverSpec& driver, llvm::BasicBlock *bb)
+LLVMWriter::ValueCache::findEntry(const Key& key, llvm::BasicBlock *bb)
 {
-  // equal_range() returns a pair of iterators
-  auto range = _mmap.equal_range(driver);
+  int head = _slots.empty() ? -1 : findSlot(key).head;
 
-  if (range.first == range.second)  {
+  if (head < 0)  {
     ++_nMisses;
     return nullptr;  // Empty cache
   }
 
-  for (auto pos = range.first; pos != range.second; ++pos) {
-    llvm::Value *value = pos->second;
-    llvm::Instruction *instr =  llvm::dyn_cast<llvm::Instruction>(value);
-    log_assert(instr);
-
-    // First look for a cached value in the same BB.
+  // First look for a cached value in the same BB.
+  for (int e = head; e >= 0; e = _entries[e].next) {
+    llvm::Instruction *instr = _entries[e].instr;
     if (!bb || instr->getParent() == bb) {
       log_debug("returning cached value in BB %s same as desired BB\n",
           instr->getParent()->getName().str().c_str());
       ++_nHits;
-      return value;
+      return instr;
     }
   }
 
   // If no luck, look for a value in a dominating BB.
-  for (auto pos = range.first; pos != range.second; ++pos) {
-    llvm::Value *value = pos->second;
-    llvm::Instruction *instr =  llvm::dyn_cast<llvm::Instruction>(value);
-    if (_DT.dominates(instr->getParent(), bb)) {
+  for (int e = head; e >= 0; e = _entries[e].next) {
+    llvm::Instruction *instr = _entries[e].instr;
+    if (domTree().dominates(instr->getParent(), bb)) {
       ++_nHits;
       log_debug("returning cached value in BB %s desired BB: %s\n",
           instr->getParent()->getName().str().c_str(),
           bb->getName().str().c_str());
-      return value;
+      return instr;
     } else {
       log_debug("cached value in BB %s does not dominate desired BB: %s\n",
           instr->getParent()->getName().str().c_str(),
@@ -298,6 +498,33 @@ LLVMWriter::ValueCache::find(const DriverSpec& driver, llvm::BasicBlock *bb)
 }
 
 
+llvm::Value *
+LLVMWriter::ValueCache::find(const DriverSpec& driver, llvm::BasicBlock *bb)
+{
+  Key key;
+  if (!driverKey(driver, false, key)) {
+    ++_nMisses;
+    return nullptr;  // Never added
+  }
+  return findEntry(key, bb);
+}
+
+
+llvm::Value *
+LLVMWriter::ValueCache::find(const DriverChunk& chunk, llvm::BasicBlock *bb)
+{
+  return findEntry(chunkKey(chunk, 0, chunk.size()), bb);
+}
+
+
+llvm::Value *
+LLVMWriter::ValueCache::findPlaced(const DriverChunk& chunk, int destOffset, int totalWidth,
+                                   llvm::BasicBlock *bb)
+{
+  return findEntry(chunkKey(chunk, destOffset, totalWidth), bb);
+}
+
+
 // Generate code to load a Value from the given index of the given array.
 // Used for accessing ASVs in register arrays.
 // Post LLVM 14, pointers are untyped, so we do not try to deduce
@@ -337,8 +564,8 @@ LLVMWriter::generateLoad(llvm::Value *array, unsigned elementWidth, unsigned idx
 }
 
 
-// Similar to above, but to store to array.  There is no Value to return.
-void
+// Similar to above, but to store to array.  The store instruction is returned.
+llvm::StoreInst *
 LLVMWriter::generateStore(llvm::Value *array, unsigned idx, llvm::Value *val)
 {
 
@@ -357,7 +584,7 @@ LLVMWriter::generateStore(llvm::Value *array, unsigned idx, llvm::Value *val)
   // If no width conversion is needed, no zext or trunc instruction will be generated here.
   llvm::Value *paddedVal = b->CreateZExtOrTrunc(val, paddedElementTy);
 
-  b->CreateStore(paddedVal, gep);
+  return b->CreateStore(paddedVal, gep);
 }
 
 
@@ -368,11 +595,8 @@ LLVMWriter::generateInputValue(RTLIL::Cell *cell, RTLIL::IdString port)
   log_assert(cell->hasPort(port));
   log_assert(cell->input(port));
 
-  DriverSpec dSpec;
-  finder.buildDriverOf(cell->getPort(port), dSpec);
-
   // Get the Value for the input connection
-  return generateValue(dSpec);
+  return generateValue(finder->driverOf(cell, port));
 }
 
 
@@ -708,10 +932,9 @@ LLVMWriter::generateBinaryCellOutputValue(RTLIL::Cell *cell)
 
     // If input B's MSB is known to be zero, we can avoid worrying about
     // left shifts.
-    DriverSpec dSpec;
-    finder.buildDriverOf(cell->getPort(ID::B), dSpec);
+    const DriverSpec& dSpec = finder->driverOf(cell, ID::B);
 
-    if (!signedB || dSpec[dSpec.size()-1] == RTLIL::S0) {
+    if (!signedB || dSpec.msb() == RTLIL::S0) {
       val = b->CreateLShr(valA, valB);
     } else {
       llvm::Value *shiftR = b->CreateLShr(valA, valB); // Assuming B >= 0
@@ -940,19 +1163,43 @@ LLVMWriter::generatePmuxCellOutputValue(RTLIL::Cell *cell)
   
   // The driverSpec of input B is typically a concatenation of a bunch of things.
   // For each output choice, we generate the correct slice of B.
-  DriverSpec bSpec;
-  finder.buildDriverOf(cell->getPort(ID::B), bSpec);
+  const DriverSpec& bSpec = finder->driverOf(cell, ID::B);
+
+  // The select can be constant, e.g. in a case of an enclosing pmux on the
+  // same select signal.  Then there is no need for a switch.
+  if (llvm::ConstantInt *constS = llvm::dyn_cast<llvm::ConstantInt>(valS)) {
+    const llvm::APInt& s = constS->getValue();
+    if (s.isPowerOf2()) {
+      unsigned n = s.logBase2();
+      return generateValue(bSpec.extract(n * cellWidthAY, cellWidthAY));
+    }
+    return generateInputValue(cell, ID::A);
+  }
+
+  const DriverSpec& sSpec = finder->driverOf(cell, ID::S);
 
   llvm::BasicBlock *originalBB = b->GetInsertBlock();
 
   std::string bbBaseName = "switch" + std::to_string(pmuxIdx);
 
+  // Another BB for the continuation past the switch cases.  If originalBB
+  // is already terminated (e.g. it is a case BB of an enclosing pmux), the
+  // rest of it, including the terminator, moves there.
+  llvm::BasicBlock *postBB;
+  if (originalBB->getTerminator()) {
+    postBB = originalBB->splitBasicBlock(b->GetInsertPoint(), bbBaseName+"_post");
+    originalBB->getTerminator()->eraseFromParent();
+    for (llvm::BasicBlock *succ : llvm::successors(postBB)) {
+      valueCache.deleteEdge(originalBB, succ);
+      valueCache.insertEdge(postBB, succ);
+    }
+  } else {
+    postBB = llvm::BasicBlock::Create(*c, bbBaseName+"_post", llvmFunc);
+  }
+
   // Create a new BB for the default case
   llvm::BasicBlock *defaultBB = llvm::BasicBlock::Create(*c, bbBaseName+"_default", llvmFunc);
 
-  // Another BB for the continuation past the switch cases
-  llvm::BasicBlock *postBB = llvm::BasicBlock::Create(*c, bbBaseName+"_post", llvmFunc);
-
   // Make the switch instruction that will terminate the original BB.
   b->SetInsertPoint(originalBB);
   llvm::SwitchInst *switchInst = b->CreateSwitch(valS, defaultBB, numCases);
@@ -961,9 +1208,22 @@ LLVMWriter::generatePmuxCellOutputValue(RTLIL::Cell *cell)
   b->SetInsertPoint(defaultBB);
   b->CreateBr(postBB);
 
+  valueCache.insertEdge(originalBB, defaultBB);
+  valueCache.insertEdge(defaultBB, postBB);
+
+  if (fusedFunc) {
+    auto it = fusedBBSwitch.find(originalBB);
+    if (it != fusedBBSwitch.end()) {
+      fusedBBSwitch[postBB] = it->second;
+    }
+    fusedBBSwitch[defaultBB] = switchInst;
+    fusedSwitchPost[switchInst] = postBB;
+    fusedPostSwitch[postBB] = switchInst;
+  }
+
   // We need to create all the case BBs and their termination branch
   // instructions before adding anything else to the branches, so that
-  // we can properly update the dominance tree.
+  // the dominance tree sees the whole switch.
   
   std::vector<llvm::BasicBlock*> bbs(numCases);
 
@@ -983,39 +1243,72 @@ LLVMWriter::generatePmuxCellOutputValue(RTLIL::Cell *cell)
 
     // Update the switch instruction with the data for this case.
     switchInst->addCase(caseVal, caseBB);
-  }
 
-  valueCache.updateDominance();
+    valueCache.insertEdge(originalBB, caseBB);
+    valueCache.insertEdge(caseBB, postBB);
+
+    if (fusedFunc) {
+      fusedBBSwitch[caseBB] = switchInst;
+    }
+  }
 
-  // Now fill in each case BB, and the default BB
+  // Now fill in each case BB, and the default BB.  A nested pmux may split
+  // them, so each Phi incoming BB is the one where generation ended.
 
   b->SetInsertPoint(defaultBB, defaultBB->begin());
   llvm::Value *defaultVal = generateInputValue(cell, ID::A);  // Possibly lots of recursion here
+  llvm::BasicBlock *defaultEndBB = b->GetInsertBlock();
 
   // We have to put a Phi instruction at the beginning of postBB,
   // to gather the values of each case.
   b->SetInsertPoint(postBB, postBB->begin());
   llvm::PHINode *phiInst = b->CreatePHI(defaultVal->getType(), numCases+1);
 
-  phiInst->addIncoming(defaultVal, defaultBB);
+  phiInst->addIncoming(defaultVal, defaultEndBB);
   
   for (unsigned n = 0, offset = 0; n < numCases; n++, offset += cellWidthAY) {
 
     // Get the previously-created BB for the this case
     llvm::BasicBlock *caseBB = bbs[n];
 
+    // The switch only gets here if select bit n is the only one set.
+    // Facts from enclosing cases stay, unless this overrides them.
+    auto savedFacts = branchFacts;
+    auto savedFactObjects = branchFactObjects;
+    if (opts.branch_facts) {
+      unsigned i = 0;
+      for (const DriverChunk& chunk : sSpec.chunks()) {
+        if (chunk.is_data()) {
+          i += chunk.size();
+          continue;
+        }
+        for (int j = 0; j < chunk.size(); j++, i++) {
+          branchFacts[DriverBit(chunk, j)] = (i == n) ? RTLIL::State::S1 : RTLIL::State::S0;
+        }
+        branchFactObjects.insert(chunk.wire ? (const void*)chunk.wire : (const void*)chunk.cell);
+      }
+    }
+
     // Create the instructions for this case
     b->SetInsertPoint(caseBB, caseBB->begin());
     DriverSpec sliceSpec = bSpec.extract(offset, cellWidthAY) ;
     llvm::Value *sliceVal = generateValue(sliceSpec);  // Possibly lots of recursion here
 
     //  Update the Phi instruction at the beginning of postBB.
-    phiInst->addIncoming(sliceVal, caseBB);
+    phiInst->addIncoming(sliceVal, b->GetInsertBlock());
+
+    branchFacts = std::move(savedFacts);
+    branchFactObjects = std::move(savedFactObjects);
   }
 
   // From now on, instructions go in the newly-created post BB,
-  // right after the Phi instrction we put in it.
-  b->SetInsertPoint(postBB);
+  // right after the Phi instrction we put in it (and before the
+  // terminator it may have taken from originalBB).
+  if (postBB->getTerminator()) {
+    b->SetInsertPoint(postBB->getTerminator());
+  } else {
+    b->SetInsertPoint(postBB);
+  }
 
   return phiInst;
 }
@@ -1135,6 +1428,10 @@ LLVMWriter::generateUserDefinedCellOutputValue(RTLIL::Cell *cell, RTLIL::IdStrin
 llvm::Value *
 LLVMWriter::generateFFCellOutputValue(RTLIL::Cell *cell)
 {
+  if (timeFrame) {
+    return generateTimeFrameFFOutputValue(cell);
+  }
+
   // FF cells should not exist in the unrolled design.
   // But when generatin sub-functions, we can tolerate FFs that
   // drive a sub-module output port.
@@ -1149,6 +1446,147 @@ LLVMWriter::generateFFCellOutputValue(RTLIL::Cell *cell)
 }
 
 
+// Find or create a Value representing what drives the given SigSpec.
+llvm::Value *
+LLVMWriter::generateSigValue(const RTLIL::SigSpec& sig)
+{
+  DriverSpec dSpec;
+  finder->buildDriverOf(sig, dSpec);
+  return generateValue(dSpec);
+}
+
+
+llvm::Value *
+LLVMWriter::generateSelect(llvm::Value *cond, llvm::Value *valTrue, llvm::Value *valFalse)
+{
+  if (opts.simplify_muxes) {
+    if (isAllOnes(cond)) {
+      return valTrue;
+    } else if (isZero(cond)) {
+      return valFalse;
+    }
+  }
+  return b->CreateSelect(cond, valTrue, valFalse);
+}
+
+
+RTLIL::IdString
+LLVMWriter::frameName(RTLIL::IdString name)
+{
+  if (!timeFrame) {
+    return name;
+  } else if (stepLoopFrame && valueCache.cycle() == stepLoopFrame) {
+    return name.str() + "__step_";
+  }
+  return cycleize_name(name, valueCache.cycle());
+}
+
+
+// The cycle whose input values apply to the current time frame.
+int
+LLVMWriter::inputCycle()
+{
+  int cycle = valueCache.cycle();
+  return (stepLoopFrame && cycle == stepLoopFrame) ? stepLoopCycle : cycle;
+}
+
+
+// In time-frame mode, the value of a FF's Q output in a cycle is the value
+// the FF loaded in the previous cycle.  The logic that split_ff() would add
+// to an unrolled module is modeled directly here.  In the first cycle the
+// value is the register's initial value, an ASV function arg or a reset value.
+// If a step loop was generated, the final-cycle value is the loop's result.
+
+llvm::Value *
+LLVMWriter::generateTimeFrameFFOutputValue(RTLIL::Cell *cell)
+{
+  log_assert(timeFrame);
+
+  FfData ff(nullptr, cell);
+  int cycle = valueCache.cycle();
+
+  log_assert(!stepLoopFrame || cycle != stepLoopFrame);
+
+  if (cycle == timeFrame->num_cycles+1 && stepLoopResults.count(cell)) {
+    return stepLoopResults.at(cell);
+  }
+
+  if (cycle == 1) {
+    // The initial value is described by the Q wire(s) themselves.
+    DriverSpec qSpec;
+    for (const RTLIL::SigChunk& chunk : ff.sig_q.chunks()) {
+      if (chunk.wire) {
+        qSpec.append(DriverChunk(chunk.wire, chunk.offset, chunk.width));
+      } else {
+        qSpec.append(RTLIL::Const(chunk.data));
+      }
+    }
+    return generateValue(qSpec);
+  }
+
+  // Generate the next-state logic in the previous cycle.
+  valueCache.setCycle(cycle-1);
+  llvm::Value *val = generateFFNextStateValue(cell);
+  valueCache.setCycle(cycle);
+
+  return val;
+}
+
+
+// Generate the value that the given FF will load at the end of the current
+// time frame.
+
+llvm::Value *
+LLVMWriter::generateFFNextStateValue(RTLIL::Cell *cell)
+{
+  FfData ff(nullptr, cell);
+
+  if (ff.has_gclk || !ff.has_clk || ff.has_sr || ff.has_arst || ff.has_aload) {
+    log_error("FF cell `%s' type %s is not supported\n", cell->name.c_str(), cell->type.c_str());
+    return llvmZero(ff.width);
+  }
+
+  llvm::Value *valD = generateSigValue(ff.sig_d);
+  llvm::Value *valQ = nullptr;
+  llvm::Value *ce = nullptr;
+  llvm::Value *srst = nullptr;
+  llvm::Value *valSrst = nullptr;
+
+  if (ff.has_ce) {
+    valQ = generateSigValue(ff.sig_q);
+    ce = generateSigValue(ff.sig_ce);
+    if (!ff.pol_ce) {
+      ce = b->CreateNot(ce);
+    }
+  }
+  if (ff.has_srst) {
+    valSrst = generateValue(DriverSpec(ff.val_srst));
+    srst = generateSigValue(ff.sig_srst);
+    if (!ff.pol_srst) {
+      srst = b->CreateNot(srst);
+    }
+  }
+
+  llvm::Value *val = nullptr;
+  if (ff.has_srst && ff.has_ce) {
+    if (!ff.ce_over_srst) {
+      val = generateSelect(srst, valSrst, generateSelect(ce, valD, valQ));
+    } else {
+      val = generateSelect(ce, generateSelect(srst, valSrst, valD), valQ);
+    }
+  } else if (ff.has_srst) {
+    val = generateSelect(srst, valSrst, valD);
+  } else if (ff.has_ce) {
+    val = generateSelect(ce, valD, valQ);
+  } else {
+    val = valD;
+  }
+
+  return val;
+}
+
+
+
 // Create a Value representing the output port of the given cell.
 // Since this is not given a DriverSpec, it does not touch the valueCache.
 // The caller is reponsible for that.
@@ -1243,12 +1681,12 @@ LLVMWriter::generateCellOutputValue(RTLIL::Cell *cell, RTLIL::IdString port)
 
   if (llvm::isa<llvm::Instruction>(val) && val->getName().empty()) {
     if (opts.cell_based_llvm_value_names) {
-      val->setName(internalToLLVM(cell->name));
+      val->setName(internalToLLVM(frameName(cell->name)));
     } else if (outputSig.is_wire()) {
       RTLIL::IdString valName = outputSig.as_wire()->name;
       if (opts.verbose_llvm_value_names || valName[0] != '$') { 
         // Default: use only user defined wire names
-        val->setName(internalToLLVM(valName));
+        val->setName(internalToLLVM(frameName(valName)));
       }
     }
   }
@@ -1258,6 +1696,32 @@ LLVMWriter::generateCellOutputValue(RTLIL::Cell *cell, RTLIL::IdString port)
 
 
 
+// Append the values branchFacts gives the chunk's bits, LSB first.
+// Returns false if they are not all known.
+bool
+LLVMWriter::getBranchFacts(const DriverChunk& chunk, std::vector<RTLIL::State>& bits)
+{
+  if (chunk.is_data()) {
+    bits.insert(bits.end(), chunk.data.begin(), chunk.data.end());
+    return true;
+  }
+
+  const void *object = chunk.wire ? (const void*)chunk.wire : (const void*)chunk.cell;
+  if (!branchFactObjects.count(object)) {
+    return false;  // The usual case, and cheap
+  }
+
+  for (int i = 0; i < chunk.size(); i++) {
+    auto it = branchFacts.find(DriverBit(chunk, i));
+    if (it == branchFacts.end()) {
+      return false;
+    }
+    bits.push_back(it->second);
+  }
+  return true;
+}
+
+
 // Generate the value of the given chunk, which is constant, or a
 // slice of a single wire or cell output.  The result will be offset
 // by the given amount, and zero-extended to totalWidth.
@@ -1312,6 +1776,19 @@ LLVMWriter::generateChunkValue(const DriverChunk& chunk,
   // OK, the chunk is a slice of a wire or cell output.
   log_assert (chunk.size() <= chunk.object_width() - chunk.offset); // Basic sanity check
 
+  if (!branchFacts.empty()) {
+    std::vector<RTLIL::State> bits;
+    if (getBranchFacts(chunk, bits)) {
+      return generateChunkValue(DriverChunk(RTLIL::Const(bits)), totalWidth, offset);
+    }
+  }
+
+  // Concatenations often re-use the same slices in the same places
+  // (e.g. instruction fields), so the placed slice is cached too.
+  if (llvm::Value *val = valueCache.findPlaced(chunk, offset, totalWidth, b->GetInsertBlock())) {
+    return val;
+  }
+
   if (offset == chunk.offset) {
     // The signal bits do not need to be shifted - we just have to zero-extend
     // and/or truncate it, and maybe zero out some low-order bits.
@@ -1345,9 +1822,7 @@ LLVMWriter::generateChunkValue(const DriverChunk& chunk,
       val = generateAndCellOutputValue(val, mask);
     }
 
-    // TODO: Is it worth adding this to the valueCache?  It would be necessary
-    // to create a relatively complex temporary DriverSpec to serve as the key.
-
+    valueCache.addPlaced(chunk, offset, totalWidth, val);
     return val;
   } 
 
@@ -1355,8 +1830,7 @@ LLVMWriter::generateChunkValue(const DriverChunk& chunk,
   // TODO: This can be simplified!
 
   // See if we already have a Value for this (non-offset) object slice
-  DriverSpec tmpDs(chunk);
-  llvm::Value *val = valueCache.find(tmpDs, b->GetInsertBlock());
+  llvm::Value *val = valueCache.find(chunk, b->GetInsertBlock());
 
   if (!val) {
     // If not, we have to generate it.
@@ -1379,7 +1853,7 @@ LLVMWriter::generateChunkValue(const DriverChunk& chunk,
 
     // If we actually did any shifting or truncating, add the new Value to valueCache.
     if (val != objVal) {
-      valueCache.add(tmpDs, val);
+      valueCache.add(chunk, val);
     }
   }
 
@@ -1399,9 +1873,7 @@ LLVMWriter::generateChunkValue(const DriverChunk& chunk,
     val = b->CreateShl(val, offset);
   }
 
-  // TODO: Is it worth adding this to the valueCache?  It would be necessary
-  // to create a relatively complex temporary DriverSpec to serve as the key.
-
+  valueCache.addPlaced(chunk, offset, totalWidth, val);
   return val;
 }
 
@@ -1420,8 +1892,7 @@ LLVMWriter::generatePrimaryInputValue(RTLIL::Wire *port)
   if (!port->has_attribute(TARGET_VECTOR_ATTR)) {
     // A regular ASV that is supposed to have a function argument.
     // Simply find the correct arg.
-    val = llvmFunc->getValueSymbolTable()->lookup(argname);
-    log_assert(val);
+    val = generateArgValue(argname);
 
   } else {
     // Get the correct array and index from attributes we previously set on the port,
@@ -1442,30 +1913,239 @@ LLVMWriter::generatePrimaryInputValue(RTLIL::Wire *port)
 }
 
 
-// Generate the Value for the given Driverspec.  This function
-// may recursively call lots of other stuff.
+// Find the main function's scalar arg with the given name.  With
+// -state_struct_abi, integer args are instead loaded from the state struct,
+// at the current insert point, like the elements of ASV arrays.
 
 llvm::Value *
-LLVMWriter::generateValue(const DriverSpec& dSpec)
+LLVMWriter::generateArgValue(const std::string& argname)
 {
-  llvm::Value *val = valueCache.find(dSpec, b->GetInsertBlock());
-  if (val) {
-    return val;  // Should often be the case.
+  auto it = stateFields.find(argname);
+  if (it == stateFields.end()) {
+    llvm::Value *val = llvmFunc->getValueSymbolTable()->lookup(argname);
+    log_assert(val);
+    return val;
   }
 
-  if (dSpec.is_wire()) {
-    // An entire wire, which is supposed to represent a module input port.
-    log_debug("generateValue for primary input port\n");
-    log_debug_driverspec(dSpec);
+  const StateField& field = it->second;
+  llvm::Value *state = llvmFunc->getValueSymbolTable()->lookup(STATE_STRUCT_PTR_ID);
+  log_assert(state);
 
-    // The generated Value could be either a function arg or a load instruction.
-    llvm::Value *val = generatePrimaryInputValue(dSpec.as_wire());
-    valueCache.add(dSpec, val);
-    return val;
+  // The layout keeps each field naturally aligned, up to 8 bytes.
+  llvm::Type *paddedTy = llvmWidth(field.size * 8);
+  llvm::Value *ptr = b->CreateConstInBoundsGEP1_32(llvmWidth(8), state, field.offset);
+  ptr = b->CreateBitCast(ptr, llvm::PointerType::getUnqual(paddedTy));
+  llvm::Align align(std::min(field.size, 8));
 
-  } else if (dSpec.is_cell()) {
-    // An entire cell output.
-    RTLIL::IdString portName;
+  if (field.size * 8 == field.width) {
+    return b->CreateAlignedLoad(paddedTy, ptr, align, argname);
+  }
+  llvm::Value *paddedVal = b->CreateAlignedLoad(paddedTy, ptr, align);
+  return b->CreateTrunc(paddedVal, llvmWidth(field.width), argname);
+}
+
+
+// Generate a value for a wire of the original module in time-frame mode:
+// either an input port in the current cycle, or a register's initial value
+// (which is a function arg or a constant).
+
+llvm::Value *
+LLVMWriter::generateTimeFrameWireValue(RTLIL::Wire *wire)
+{
+  log_assert(timeFrame);
+  int cycle = inputCycle();
+  std::string argname = internalToLLVM(cycleize_name(wire->name, cycle), true);
+
+  if (!wire->port_input) {
+    log_assert(cycle == 1);
+
+    if (timeFrame->targets.count(wire->name)) {
+      return generateArgValue(argname);
+    }
+
+    auto member = timeFrame->targetVectorMembers.find(wire->name);
+    if (member != timeFrame->targetVectorMembers.end()) {
+      std::string arrayName = internalToLLVM(cycleize_name(member->second.first, 1));
+      llvm::Value *array = llvmFunc->getValueSymbolTable()->lookup(arrayName);
+      log_assert(array);
+      return generateLoad(array, wire->width, member->second.second, argname);
+    }
+  }
+
+  auto it = timeFrame->values.at(cycle).find(wire->name);
+  if (it == timeFrame->values.at(cycle).end()) {
+    if (wire->name != timeFrame->clock) {
+      log_warning("No value for %s %s in cycle %d\n", wire->port_input ? "input port" : "register",
+                  wire->name.c_str(), cycle);
+    }
+    return llvmUndefValue(wire->width);
+  }
+
+  const RTLIL::Const& value = it->second;
+  log_assert(GetSize(value) == wire->width);
+
+  if (wire->port_input && timeFrame->exposedInputs.count(wire->name) && !value.is_fully_def()) {
+    // The x bits come from a function arg.
+    llvm::Value *arg = generateArgValue(argname);
+    if (value.is_fully_undef()) {
+      return arg;
+    }
+
+    std::string maskStr, onesStr;
+    for (int i = wire->width-1; i >= 0; --i) {
+      bool def = (value[i] == RTLIL::State::S0 || value[i] == RTLIL::State::S1);
+      maskStr += def ? '0' : '1';
+      onesStr += (value[i] == RTLIL::State::S1) ? '1' : '0';
+    }
+    llvm::ConstantInt *mask = llvm::ConstantInt::get(llvmWidth(wire->width),
+                                                     llvm::StringRef(maskStr), 2 /*radix*/);
+    llvm::ConstantInt *ones = llvm::ConstantInt::get(llvmWidth(wire->width),
+                                                     llvm::StringRef(onesStr), 2 /*radix*/);
+    return b->CreateOr(b->CreateAnd(arg, mask), ones, argname+"_encoded");
+  }
+
+  return generateValue(DriverSpec(value));
+}
+
+
+#ifdef USE_STACK_SEGMENTS
+
+// Each stack segment is this big, and a new one is started when less than
+// STACK_RED_ZONE bytes are left.  One netlist level of recursion takes
+// at most a few KB.
+static constexpr size_t STACK_SEGMENT_SIZE = 64 << 20;
+static constexpr size_t STACK_RED_ZONE = 256 << 10;
+
+
+// What a stack segment needs to know to continue generateValue().  An
+// exception must not unwind past the segment's entry function, so it is
+// caught there and rethrown on the caller's stack.
+struct StackSegmentCall {
+  LLVMWriter *writer;
+  const DriverSpec *dSpec;
+  llvm::Value *result;
+  std::exception_ptr exception;
+};
+
+
+// makecontext() can only pass int args, so the call is handed to the
+// segment's entry function here instead.  The entry function picks it up as
+// soon as it starts, before any nested switch can replace it.
+static thread_local StackSegmentCall *pendingStackSegmentCall = nullptr;
+
+
+void
+LLVMWriter::stackSegmentEntry()
+{
+  StackSegmentCall *call = pendingStackSegmentCall;
+  try {
+    call->result = call->writer->generateValue(*call->dSpec);
+  } catch (...) {
+    call->exception = std::current_exception();
+  }
+}
+
+
+llvm::Value *
+LLVMWriter::generateValueOnNewStack(const DriverSpec& dSpec)
+{
+  // Segments are nested like the calls, so the next one down is free.
+  // Not zero-initialized, so the OS only commits the pages that get used.
+  if (stackSegmentsInUse == stackSegments.size()) {
+    stackSegments.emplace_back(new char[STACK_SEGMENT_SIZE]);
+  }
+  char *segment = stackSegments[stackSegmentsInUse].get();
+
+  StackSegmentCall call = { this, &dSpec, nullptr, nullptr };
+
+  ucontext_t caller, callee;
+  getcontext(&callee);
+  callee.uc_stack.ss_sp = segment;
+  callee.uc_stack.ss_size = STACK_SEGMENT_SIZE;
+  callee.uc_link = &caller;  // Resume here when stackSegmentEntry() returns
+  makecontext(&callee, &LLVMWriter::stackSegmentEntry, 0);
+
+  log_debug("Continuing code generation on a new stack segment\n");
+
+  const char *savedStackLow = stackLow;
+  stackLow = segment;
+  stackSegmentsInUse++;
+  pendingStackSegmentCall = &call;
+  swapcontext(&caller, &callee);
+  stackSegmentsInUse--;
+  stackLow = savedStackLow;
+
+  if (call.exception) {
+    std::rethrow_exception(call.exception);
+  }
+  return call.result;
+}
+
+#endif
+
+
+// Generate the Value for the given Driverspec.  This function
+// may recursively call lots of other stuff.
+
+llvm::Value *
+LLVMWriter::generateValue(const DriverSpec& dSpec)
+{
+#ifdef USE_STACK_SEGMENTS
+  // Find the bottom of this thread's stack, the first time through.
+  if (!stackLowKnown) {
+    stackLowKnown = true;
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+      void *addr;
+      size_t size;
+      if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        stackLow = static_cast<const char*>(addr);
+      }
+      pthread_attr_destroy(&attr);
+    }
+  }
+
+  char marker;
+  if (stackLow && &marker < stackLow + STACK_RED_ZONE) {
+    return generateValueOnNewStack(dSpec);
+  }
+#endif
+
+  // Inside a pmux case, a known value takes precedence over one that was
+  // generated before the switch.
+  if (!branchFacts.empty()) {
+    std::vector<RTLIL::State> bits;
+    bool known = true;
+    for (const DriverChunk& chunk : dSpec.chunks()) {
+      if (!getBranchFacts(chunk, bits)) {
+        known = false;
+        break;
+      }
+    }
+    if (known && !dSpec.is_fully_const()) {
+      return generateValue(DriverSpec(RTLIL::Const(bits)));
+    }
+  }
+
+  llvm::Value *val = valueCache.find(dSpec, b->GetInsertBlock());
+  if (val) {
+    return val;  // Should often be the case.
+  }
+
+  if (dSpec.is_wire()) {
+    // An entire wire, which is supposed to represent a module input port.
+    log_debug("generateValue for primary input port\n");
+    log_debug_driverspec(dSpec);
+
+    // The generated Value could be either a function arg or a load instruction.
+    llvm::Value *val = timeFrame ? generateTimeFrameWireValue(dSpec.as_wire()) :
+                                   generatePrimaryInputValue(dSpec.as_wire());
+    valueCache.add(dSpec, val);
+    return val;
+
+  } else if (dSpec.is_cell()) {
+    // An entire cell output.
+    RTLIL::IdString portName;
     RTLIL::Cell *cell = dSpec.as_cell(portName);
     llvm::Value *val = generateCellOutputValue(cell, portName);
     valueCache.add(dSpec, val);
@@ -1500,6 +2180,13 @@ LLVMWriter::generateValue(const DriverSpec& dSpec)
     log_debug("generateValue for complex Driverspec\n");
     log_debug_driverspec(dSpec);
 
+    if (opts.plan_concat) {
+      if (llvm::Value *val = generatePlannedConcat(dSpec)) {
+        valueCache.add(dSpec, val);
+        return val;
+      }
+    }
+
     std::vector<llvm::Value*> values;
     int offset = 0;
     for (const DriverChunk& chunk : dSpec.chunks()) {
@@ -1535,6 +2222,99 @@ LLVMWriter::generateValue(const DriverSpec& dSpec)
 
 
 
+// Return true iff the chunks are slices of the same wire or cell port.
+static bool
+sameObject(const DriverChunk& a, const DriverChunk& b)
+{
+  return a.wire == b.wire && a.cell == b.cell && a.port == b.port;
+}
+
+
+llvm::Value *
+LLVMWriter::generatePlannedConcat(const DriverSpec& dSpec)
+{
+  const DriverSpec::ChunkVector& chunks = dSpec.chunks();
+  int width = dSpec.size();
+
+  if (chunks.size() < 2) {
+    return nullptr;
+  }
+  for (const DriverChunk& chunk : chunks) {
+    if (!chunk.is_object()) {
+      return nullptr;  // Constant chunks are cheap to OR in.
+    }
+  }
+
+  const DriverChunk& first = chunks[0];
+  bool oneObject = true;
+  for (const DriverChunk& chunk : chunks) {
+    oneObject = oneObject && sameObject(chunk, first);
+  }
+
+  if (oneObject) {
+    // A contiguous slice that was not packed into one chunk
+    bool ascending = true;
+    for (size_t i = 1; i < chunks.size(); ++i) {
+      ascending = ascending &&
+                  chunks[i].offset == chunks[i-1].offset + chunks[i-1].width;
+    }
+    if (ascending) {
+      DriverChunk slice = first;
+      slice.width = width;
+      return generateChunkValue(slice, width, 0);
+    }
+
+    // A slice followed by copies of its top bit
+    int signBit = first.offset + first.width - 1;
+    bool signExtended = true;
+    for (size_t i = 1; i < chunks.size(); ++i) {
+      signExtended = signExtended && chunks[i].width == 1 && chunks[i].offset == signBit;
+    }
+    if (signExtended) {
+      llvm::Value *val = generateChunkValue(first, first.width, 0);
+      return b->CreateSExt(val, llvmWidth(width));
+    }
+
+    // Equal-sized pieces of a slice in reverse order: single bits are a
+    // bit reversal, and bytes are a byte swap (LLVM's bswap needs a whole
+    // number of 16-bit halves).
+    bool reversed = true;
+    for (size_t i = 1; i < chunks.size(); ++i) {
+      reversed = reversed && chunks[i].width == first.width &&
+                 chunks[i].offset == chunks[i-1].offset - first.width;
+    }
+    if (reversed && (first.width == 1 || (first.width == 8 && width % 16 == 0))) {
+      DriverChunk slice = chunks.back();
+      slice.width = width;
+      llvm::Value *val = generateChunkValue(slice, width, 0);
+      llvm::Intrinsic::ID id = first.width == 1 ? llvm::Intrinsic::bitreverse :
+                                                  llvm::Intrinsic::bswap;
+      return b->CreateUnaryIntrinsic(id, val);
+    }
+  }
+
+  // {A[k-1:0], B[W-1:k]} for W-bit objects A and B is fshr(A, B, k),
+  // which is a rotation when A and B are the same.
+  if (chunks.size() == 2) {
+    const DriverChunk& lo = chunks[0];
+    const DriverChunk& hi = chunks[1];
+    if (lo.object_width() == width && hi.object_width() == width &&
+        hi.offset == 0 && lo.offset == hi.width && lo.offset + lo.width == width) {
+      llvm::Value *valA = generateValue(hi.wire ? DriverSpec(hi.wire) : DriverSpec(hi.cell, hi.port));
+      llvm::Value *valB = generateValue(lo.wire ? DriverSpec(lo.wire) : DriverSpec(lo.cell, lo.port));
+      if (!valA->getType()->isIntegerTy() || !valB->getType()->isIntegerTy()) {
+        return nullptr;  // Memories
+      }
+      llvm::Value *shift = llvm::ConstantInt::get(llvmWidth(width), lo.offset);
+      return b->CreateIntrinsic(llvm::Intrinsic::fshr, {llvmWidth(width)}, {valA, valB, shift});
+    }
+  }
+
+  return nullptr;
+}
+
+
+
 // The wire represents a target ASV, and is not NOT necessarily a port
 llvm::Value *
 LLVMWriter::generateDestValue(RTLIL::Wire *wire)
@@ -1545,7 +2325,7 @@ LLVMWriter::generateDestValue(RTLIL::Wire *wire)
 
   // Collect the drivers of each bit of the wire
   DriverSpec dSpec;
-  finder.buildDriverOf(wire, dSpec);
+  finder->buildDriverOf(wire, dSpec);
 
   // Print what drives the bits of this wire
   log_debug_driverspec(dSpec);
@@ -1584,21 +2364,54 @@ LLVMWriter::generateFunctionDecl(const std::string& funcName, RTLIL::Module *mod
                                  int retWidth,    // Zero for void, negative for array
                                  int retVecSize)  // Non-zero only for LLVM vector return type
 {
-  std::vector<llvm::Type *> argTypes;
+  std::vector<std::pair<std::string, llvm::Type*>> scalarArgs;
 
   // Add every module input port, which includes the first-cycle register inputs
-  // and the unrolled versions of the original input ports.
+  // and the unrolled versions of the original input ports.  Note
+  // that the arg names come from attribues we set earlier based on their
+  // original Verilog names.  It is important to match the naming convention
+  // of the original func_extract program.  Later these argument names will be
+  // used to create func_info.txt, which is used by the sim_gen program.
   for (RTLIL::IdString portname : mod->ports) {
     RTLIL::Wire *port = mod->wire(portname);
     log_assert(port);
     // Skip ASVs in register arrays.
     if (!port->has_attribute(TARGET_VECTOR_ATTR)) {
       if (port->port_input) {
-        argTypes.push_back(getLlvmType(port));
+        // Take care to match the old func_extract behavior
+        scalarArgs.push_back({internalToLLVM(portname, true), getLlvmType(port)});
       }
     }
   }
 
+  return generateFunctionDecl(funcName, scalarArgs, targetVectors, retWidth, retVecSize);
+}
+
+
+llvm::Function*
+LLVMWriter::generateFunctionDecl(const std::string& funcName,
+                                 const std::vector<std::pair<std::string, llvm::Type*>>& scalarArgs,
+                                 const Yosys::dict<std::string, unsigned>& targetVectors,
+                                 int retWidth,    // Zero for void, negative for array
+                                 int retVecSize)  // Non-zero only for LLVM vector return type
+{
+  std::vector<llvm::Type *> argTypes;
+
+  // With -state_struct_abi, the integer scalar args are replaced by a
+  // pointer to a struct holding them, which comes first.
+  if (opts.state_struct_abi) {
+    layoutStateStruct(scalarArgs);
+  }
+  if (!stateFields.empty()) {
+    argTypes.push_back(llvm::PointerType::getUnqual(llvmWidth(8)));
+  }
+
+  for (auto& nameType : scalarArgs) {
+    if (!stateFields.count(nameType.first)) {
+      argTypes.push_back(nameType.second);
+    }
+  }
+
   // Push the types of any register array args (which are of course pointers)
   for(auto vecNameWidth: targetVectors) {
     unsigned width = vecNameWidth.second;
@@ -1645,19 +2458,23 @@ LLVMWriter::generateFunctionDecl(const std::string& funcName, RTLIL::Module *mod
 
   llvm::Function *func = llvm::Function::Create(functype, linkage, funcName, llvmMod);
 
-  // Set the function's args' names.  Note
-  // that the arg names come from attribues we set earlier based on their
-  // original Verilog names.  It is important to match the naming convention
-  // of the original func_extract program.  Later these argument names will be
-  // used to create func_info.txt, which is used by the sim_gen program.
-
+  // Set the function's args' names.
   unsigned n = 0;
-  for (RTLIL::IdString portname : mod->ports) {
-    RTLIL::Wire *port = mod->wire(portname);
-    // Skip ASVs in register arrays.
-    if (port->port_input && !port->has_attribute(TARGET_VECTOR_ATTR)) {
+  if (!stateFields.empty()) {
+    // The function only reads the struct, which the caller must align.
+    llvm::Argument *arg = func->getArg(n);
+    arg->setName(STATE_STRUCT_PTR_ID);
+    arg->addAttr(llvm::Attribute::NoCapture);
+    arg->addAttr(llvm::Attribute::ReadOnly);
+    arg->addAttr(llvm::Attribute::getWithAlignment(*c, llvm::Align(STATE_STRUCT_ALIGN)));
+    arg->addAttr(llvm::Attribute::getWithDereferenceableBytes(*c, stateSize));
+    n++;
+  }
+
+  for (auto& nameType : scalarArgs) {
+    if (!stateFields.count(nameType.first)) {
       llvm::Argument *arg = func->getArg(n);
-      arg->setName(internalToLLVM(portname, true));  // Take care to match the old func_extract behavior
+      arg->setName(nameType.first);
       n++;
     }
   }
@@ -1681,6 +2498,127 @@ LLVMWriter::generateFunctionDecl(const std::string& funcName, RTLIL::Module *mod
 }
 
 
+// Lay out the integer scalar args in the state struct for -state_struct_abi.
+// The fields go in order of decreasing size, so that each one is naturally
+// aligned (up to 8 bytes) without any padding between them.  The struct is
+// padded to a whole number of cache lines.  Other args (e.g. LLVM vectors
+// for memories) are still passed on their own.
+void
+LLVMWriter::layoutStateStruct(const std::vector<std::pair<std::string, llvm::Type*>>& scalarArgs)
+{
+  std::vector<std::pair<std::string, int>> intArgs;  // Name and width
+  for (auto& nameType : scalarArgs) {
+    if (nameType.second->isIntegerTy()) {
+      intArgs.push_back({nameType.first, getWidth(nameType.second)});
+    }
+  }
+
+  std::stable_sort(intArgs.begin(), intArgs.end(),
+                   [](const std::pair<std::string, int>& a, const std::pair<std::string, int>& b) {
+                     return funcExtract::get_padded_width(a.second) >
+                            funcExtract::get_padded_width(b.second);
+                   });
+
+  stateFields.clear();
+  int offset = 0;
+  for (auto& nameWidth : intArgs) {
+    StateField field;
+    field.width = nameWidth.second;
+    field.size = funcExtract::get_padded_width(field.width) / 8;
+    field.offset = offset;
+    offset += field.size;
+    stateFields[nameWidth.first] = field;
+  }
+
+  stateSize = (offset + STATE_STRUCT_ALIGN - 1) / STATE_STRUCT_ALIGN * STATE_STRUCT_ALIGN;
+}
+
+
+// Write the state struct layout of the main function (if it has one) next
+// to its LLVM file, with the extension replaced by '.state.txt'.  The first
+// line gives the function name, the struct size and its alignment in bytes,
+// and each following line gives an arg name, its byte offset and its width
+// in bits, in order of offset.
+void
+LLVMWriter::writeStateLayout(const std::string& llvmFileName)
+{
+  if (stateFields.empty()) {
+    return;
+  }
+
+  size_t dot = llvmFileName.find_last_of('.');
+  size_t slash = llvmFileName.find_last_of('/');
+  std::string layoutFileName = llvmFileName;
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+    layoutFileName.erase(dot);
+  }
+  layoutFileName += ".state.txt";
+
+  std::vector<std::pair<int, std::string>> fields;  // Offset and name
+  for (auto& it : stateFields) {
+    fields.push_back({it.second.offset, it.first});
+  }
+  std::sort(fields.begin(), fields.end());
+
+  std::ofstream output(layoutFileName);
+  if (!output) {
+    log_error("Cannot write %s\n", layoutFileName.c_str());
+    return;
+  }
+  output << llvmFunc->getName().str() << " " << stateSize << " " << STATE_STRUCT_ALIGN << "\n";
+  for (auto& field : fields) {
+    output << field.second << " " << field.first << " " << stateFields.at(field.second).width << "\n";
+  }
+  output.close();
+
+  log("State struct layout written to %s\n", layoutFileName.c_str());
+}
+
+
+// Point finder at the driver finder for a main function of the given module,
+// building it if needed.  A shared finder is only re-built when the module has
+// changed since it was last built, e.g. when writing the first target of a
+// newly unrolled module.
+void
+LLVMWriter::useMainDriverFinder(RTLIL::Module *mod)
+{
+  if (!sharedFinder) {
+    ownFinder.build(mod, opts.finder_pool);
+    finder = &ownFinder;
+  } else if (sharedFinder->is_current(mod)) {
+    finder = sharedFinder;
+    log("Re-using driverFinder\n");
+  } else {
+    sharedFinder->build(mod, opts.finder_pool);
+    finder = sharedFinder;
+  }
+
+  log("%ld objects in driverFinder\n", finder->size());
+}
+
+
+// We  need a collection of all known input target vectors and their widths.
+// Get this by scanning input ports and looking at attributes that our
+// caller has set on them. 
+void
+LLVMWriter::getTargetVectors(RTLIL::Module *mod,
+                             Yosys::dict<std::string, unsigned>& targetVectors)
+{
+  for (RTLIL::IdString portname : mod->ports) {
+    RTLIL::Wire *port = mod->wire(portname);
+    if (port->port_input && port->has_attribute(TARGET_VECTOR_ATTR)) {
+      std::string vecName = port->get_string_attribute(TARGET_VECTOR_ATTR);
+      if (!targetVectors.count(vecName)) {
+        targetVectors[vecName] = port->width;
+      } else {
+        // Check for consistent widths of each vector element
+        log_assert(targetVectors[vecName] == (unsigned)port->width);
+      }
+    }
+  }
+}
+
+
 // The main update function is created.  It is assumed that the llvm::Module already exists.
 // The LLVM is not written out.
 llvm::Function*
@@ -1697,25 +2635,10 @@ LLVMWriter::writeMainFunction(RTLIL::Module *unrolledRtlMod,
 
   log("Generating main function\n");
 
-  finder.build(unrolledRtlMod);
-  log("%ld objects in driverFinder\n", finder.size());
+  useMainDriverFinder(unrolledRtlMod);
 
-  // We  need a collection of all known input target vectors and their widths.
-  // Get this by scanning input ports and looking at attributes that our
-  // caller has set on them. 
   Yosys::dict<std::string, unsigned> targetVectors;
-  for (RTLIL::IdString portname : unrolledRtlMod->ports) {
-    RTLIL::Wire *port = unrolledRtlMod->wire(portname);
-    if (port->port_input && port->has_attribute(TARGET_VECTOR_ATTR)) {
-      std::string vecName = port->get_string_attribute(TARGET_VECTOR_ATTR);
-      if (!targetVectors.count(vecName)) {
-        targetVectors[vecName] = port->width;
-      } else {
-        // Check for consistent widths of each vector element
-        log_assert(targetVectors[vecName] == (unsigned)port->width);
-      }
-    }
-  }
+  getTargetVectors(unrolledRtlMod, targetVectors);
 
 
   // Now to actually start generating code
@@ -1768,7 +2691,7 @@ LLVMWriter::writeMainFunction(RTLIL::Module *unrolledRtlMod,
   
     // Collect the drivers of each bit of the destination wire
     DriverSpec dSpec;
-    finder.buildDriverOf(targetPort, dSpec);
+    finder->buildDriverOf(targetPort, dSpec);
 
     // Print what drives the bits of this wire
     log_debug_driverspec(dSpec);
@@ -1800,7 +2723,7 @@ LLVMWriter::writeMainFunction(RTLIL::Module *unrolledRtlMod,
 
         // Collect the drivers of each bit of the destination wire
         DriverSpec dSpec;
-        finder.buildDriverOf(targetPort, dSpec);
+        finder->buildDriverOf(targetPort, dSpec);
 
         // Print what drives the bits of this wire
         log_debug_driverspec(dSpec);
@@ -1848,40 +2771,316 @@ LLVMWriter::writeMainFunction(RTLIL::Module *unrolledRtlMod,
 
 
 
-std::string
-LLVMWriter::getSubFunctionName(RTLIL::Module *submod,
-                               RTLIL::IdString returnPortName)
-{
-  return "func_;_" + internalToLLVM(submod->name) + "_$" + internalToLLVM(returnPortName);
-}
-
-
+// In time-frame mode, look for a run of cycles at the end of the instruction
+// (typically NOP cycles) that all have the same fully-known input values.
+// If there is one, generate a loop that steps the registers feeding the given
+// target wires through those cycles, so that the next-state logic is
+// generated only once instead of once per cycle.  The final register values
+// are put into the valueCache for cycle num_cycles+1.
 
-// Generate a function declaration whose parameters are the module's input
-// ports, and whose return value is the given output port.  The top-level
-// ASVs, etc. are irrelevant.
-llvm::Function*
-LLVMWriter::generateSubFunctionDecl(RTLIL::Module *submod,
-                                    RTLIL::Wire *returnPort)
+void
+LLVMWriter::generateStepLoop(const std::vector<RTLIL::Wire*>& targetWires)
 {
-  std::string funcName = getSubFunctionName(submod, returnPort->name);
+  log_assert(timeFrame);
+  int num_cycles = timeFrame->num_cycles;
+
+  // Cycle 1 cannot be part of the run, since its register values are the
+  // initial values.  Input x bits that are function args differ per cycle.
+  auto loopable = [&](int cycle) {
+    for (auto& it : timeFrame->values.at(cycle)) {
+      if (timeFrame->exposedInputs.count(it.first) && !it.second.is_fully_def()) {
+        return false;
+      }
+    }
+    return cycle > 1 && timeFrame->values.at(cycle) == timeFrame->values.at(num_cycles);
+  };
 
-  std::vector<llvm::Type *> argTypes;
+  int firstCycle = num_cycles+1;
+  while (firstCycle > 1 && loopable(firstCycle-1)) {
+    --firstCycle;
+  }
+  int numSteps = num_cycles+1 - firstCycle;
 
-  // Add every module input port. The caller will expect the function args
-  // to be ordered this way - it will not match them by name.
-  for (RTLIL::IdString portname : submod->ports) {
-    RTLIL::Wire *port = submod->wire(portname);
-    log_assert(port);
-    if (port->port_input) {
-      argTypes.push_back(getLlvmType(port));
-    }
+  if (numSteps < 2) {
+    log("No repeated cycles to generate a step loop for\n");
+    return;
   }
 
-  log_assert (returnPort->port_output && !returnPort->port_input);
+  // Find the registers in the fanin of the targets.
+  std::vector<RTLIL::Cell*> stateRegs;
+  pool<RTLIL::Cell*> visited;
+  std::vector<RTLIL::Cell*> worklist;
 
-  // A return type of the correct width
-  llvm::Type* retTy = llvmWidth(returnPort->width);
+  auto pushDrivers = [&](const RTLIL::SigSpec& sig) {
+    DriverSpec dSpec;
+    finder->buildDriverOf(sig, dSpec);
+    for (const DriverChunk& chunk : dSpec.chunks()) {
+      if (chunk.cell && !visited.count(chunk.cell)) {
+        visited.insert(chunk.cell);
+        worklist.push_back(chunk.cell);
+      }
+    }
+  };
+
+  for (RTLIL::Wire *wire : targetWires) {
+    pushDrivers(RTLIL::SigSpec(wire));
+  }
+  while (!worklist.empty()) {
+    RTLIL::Cell *cell = worklist.back();
+    worklist.pop_back();
+    if (RTLIL::builtin_ff_cell_types().count(cell->type) != 0) {
+      stateRegs.push_back(cell);
+    }
+    for (auto& conn : cell->connections()) {
+      if (cell->input(conn.first)) {
+        pushDrivers(conn.second);
+      }
+    }
+  }
+
+  log("Generating a loop of %d steps (cycles %d to %d) over %d registers\n",
+      numSteps, firstCycle, num_cycles, GetSize(stateRegs));
+
+  // The register values on loop entry
+  valueCache.setCycle(firstCycle);
+  std::vector<llvm::Value*> initVals;
+  for (RTLIL::Cell *cell : stateRegs) {
+    initVals.push_back(generateValue(DriverSpec(cell, ID::Q)));
+  }
+
+  llvm::BasicBlock *preheaderBB = b->GetInsertBlock();
+  llvm::BasicBlock *loopBB = llvm::BasicBlock::Create(*c, "step_loop", llvmFunc);
+  llvm::BasicBlock *exitBB = llvm::BasicBlock::Create(*c, "step_loop_exit", llvmFunc);
+  b->CreateBr(loopBB);
+  valueCache.insertEdge(preheaderBB, loopBB);
+
+  b->SetInsertPoint(loopBB);
+
+  llvm::PHINode *counter = b->CreatePHI(llvmWidth(32), 2, "step");
+  counter->addIncoming(llvmInt(0, 32), preheaderBB);
+
+  // The body is generated in a time frame of its own, whose register values
+  // are the loop phis.
+  stepLoopFrame = num_cycles+2;
+  stepLoopCycle = firstCycle;
+  valueCache.setCycle(stepLoopFrame);
+
+  std::vector<llvm::PHINode*> phis;
+  for (size_t n = 0; n < stateRegs.size(); ++n) {
+    RTLIL::Cell *cell = stateRegs[n];
+    llvm::PHINode *phi = b->CreatePHI(initVals[n]->getType(), 2,
+                                      internalToLLVM(frameName(cell->name)));
+    phi->addIncoming(initVals[n], preheaderBB);
+    valueCache.add(DriverSpec(cell, ID::Q), phi);
+    phis.push_back(phi);
+  }
+
+  std::vector<llvm::Value*> nextVals;
+  for (RTLIL::Cell *cell : stateRegs) {
+    nextVals.push_back(generateFFNextStateValue(cell));
+  }
+
+  // Body generation may have added BBs (e.g. for $pmux cells).
+  llvm::BasicBlock *latchBB = b->GetInsertBlock();
+  llvm::Value *nextCounter = b->CreateAdd(counter, llvmInt(1, 32));
+  llvm::Value *done = b->CreateICmpEQ(nextCounter, llvmInt(numSteps, 32));
+  b->CreateCondBr(done, exitBB, loopBB);
+  valueCache.insertEdge(latchBB, exitBB);
+  valueCache.insertEdge(latchBB, loopBB);
+
+  counter->addIncoming(nextCounter, latchBB);
+  for (size_t n = 0; n < phis.size(); ++n) {
+    phis[n]->addIncoming(nextVals[n], latchBB);
+  }
+
+  stepLoopFrame = 0;
+  stepLoopCycle = 0;
+
+  // The register values after the loop are those of the final cycle.
+  b->SetInsertPoint(exitBB);
+  for (size_t n = 0; n < stateRegs.size(); ++n) {
+    stepLoopResults[stateRegs[n]] = nextVals[n];
+  }
+}
+
+
+
+// The time-frame version of writeMainFunction(): the update function is
+// generated directly from timeFrame->srcmod.  The function args are the
+// initial ASV values (as in an unrolled module's first-cycle ports) and the
+// exposed x bits of the input ports in each cycle.
+
+llvm::Function*
+LLVMWriter::writeTimeFrameFunction(std::string targetName,  // As specified in allowed_target.txt
+                                   bool targetIsVec,       // target is ASV vector
+                                   std::string funcName)
+{
+  log_assert(llvmMod);
+  log_assert(timeFrame);
+
+  RTLIL::Module *srcmod = timeFrame->srcmod;
+  int num_cycles = timeFrame->num_cycles;
+  log_assert((int)timeFrame->values.size() == num_cycles+2);
+
+  clearFunctionData();
+
+  log("Generating main function from module %s in %d time frames\n",
+      srcmod->name.c_str(), num_cycles+1);
+
+  if (!srcmod->processes.empty() || !srcmod->memories.empty()) {
+    log_error("Module %s has processes or memories, not supported in time-frame mode\n",
+              srcmod->name.c_str());
+    return nullptr;
+  }
+  for (auto cell : srcmod->cells()) {
+    if (cell->type[0] == '\\' || cell->is_mem_cell()) {
+      log_error("Cell %s type %s is not supported in time-frame mode\n",
+                cell->name.c_str(), cell->type.c_str());
+      return nullptr;
+    }
+  }
+
+  useMainDriverFinder(srcmod);
+
+  // The scalar args: initial ASV values, then the exposed inputs of each cycle.
+  std::vector<std::pair<std::string, llvm::Type*>> scalarArgs;
+  for (RTLIL::IdString name : timeFrame->targets) {
+    RTLIL::Wire *wire = srcmod->wire(name);
+    if (!wire) {
+      log_warning("Cannot find register for ASV %s\n", name.c_str());
+      continue;
+    }
+    scalarArgs.push_back({internalToLLVM(cycleize_name(name, 1), true), llvmWidth(wire->width)});
+  }
+  for (int cycle = 1; cycle <= num_cycles+1; ++cycle) {
+    for (RTLIL::IdString portname : srcmod->ports) {
+      RTLIL::Wire *port = srcmod->wire(portname);
+      auto it = timeFrame->values.at(cycle).find(portname);
+      if (port->port_input && timeFrame->exposedInputs.count(portname) &&
+          it != timeFrame->values.at(cycle).end() && !it->second.is_fully_def()) {
+        scalarArgs.push_back({internalToLLVM(cycleize_name(portname, cycle), true),
+                              llvmWidth(port->width)});
+      }
+    }
+  }
+
+  // The register array args
+  Yosys::dict<std::string, unsigned> targetVectors;
+  for (auto& member : timeFrame->targetVectorMembers) {
+    RTLIL::Wire *wire = srcmod->wire(member.first);
+    log_assert(wire);
+    std::string arrayName = internalToLLVM(cycleize_name(member.second.first, 1));
+    if (!targetVectors.count(arrayName)) {
+      targetVectors[arrayName] = wire->width;
+    } else {
+      log_assert(targetVectors[arrayName] == (unsigned)wire->width);
+    }
+  }
+
+  // Find the target wires and the function's return type.
+  std::vector<std::pair<RTLIL::Wire*, int>> targetWires;  // With vector index
+  if (!targetIsVec) {
+    RTLIL::Wire *targetWire = srcmod->wire(verilogToInternal(targetName));
+    if (!targetWire) {
+      log_error("Can't find signal for destination ASV %s\n", targetName.c_str());
+      return nullptr;
+    }
+    log("Scalar target %s\n", targetName.c_str());
+    targetWires.push_back({targetWire, -1});
+    llvmFunc = generateFunctionDecl(funcName, scalarArgs, targetVectors, targetWire->width, 0);
+  } else {
+    log("Vector target %s\n", targetName.c_str());
+    for (auto& member : timeFrame->targetVectorMembers) {
+      if (member.second.first == targetName) {
+        targetWires.push_back({srcmod->wire(member.first), member.second.second});
+      }
+    }
+    if (targetWires.empty()) {
+      log_error("Can't find any members of destination ASV vector %s\n", targetName.c_str());
+      return nullptr;
+    }
+    llvmFunc = generateFunctionDecl(funcName, scalarArgs, targetVectors,
+                                    -(targetWires.front().first->width), 0);
+  }
+
+  // basic block
+  llvm::BasicBlock *BB = llvm::BasicBlock::Create(*c, "bb_;_"+targetName, llvmFunc);
+  b->SetInsertPoint(BB);
+
+  if (opts.step_loop) {
+    std::vector<RTLIL::Wire*> wires;
+    for (auto& wireIdx : targetWires) {
+      wires.push_back(wireIdx.first);
+    }
+    generateStepLoop(wires);
+  }
+
+  // The targets are evaluated in the final cycle.
+  valueCache.setCycle(num_cycles+1);
+
+  if (!targetIsVec) {
+    llvm::Value *destValue = generateDestValue(targetWires.front().first);
+    b->CreateRet(destValue);
+  } else {
+    llvm::Value *returnValueArray = llvmFunc->getValueSymbolTable()->lookup(
+                                            funcExtract::RETURN_ARRAY_PTR_ID);
+    log_assert(returnValueArray);
+
+    for (auto& wireIdx : targetWires) {
+      log_debug("Vector target %s[%d]\n", targetName.c_str(), wireIdx.second);
+      llvm::Value *destValue = generateDestValue(wireIdx.first);
+      generateStore(returnValueArray, wireIdx.second, destValue);
+    }
+
+    b->CreateRetVoid();
+  }
+
+  log("%lu Values in valueCache\n", valueCache.size());
+  log("%lu hits, %lu misses\n", valueCache.nHits(), valueCache.nMisses());
+  log("%u LLVM instructions generated\n", llvmMod->getInstructionCount());
+
+  llvm::verifyFunction(*llvmFunc);
+  llvm::verifyModule(*llvmMod);
+
+  return llvmFunc;
+}
+
+
+
+std::string
+LLVMWriter::getSubFunctionName(RTLIL::Module *submod,
+                               RTLIL::IdString returnPortName)
+{
+  return "func_;_" + internalToLLVM(submod->name) + "_$" + internalToLLVM(returnPortName);
+}
+
+
+
+// Generate a function declaration whose parameters are the module's input
+// ports, and whose return value is the given output port.  The top-level
+// ASVs, etc. are irrelevant.
+llvm::Function*
+LLVMWriter::generateSubFunctionDecl(RTLIL::Module *submod,
+                                    RTLIL::Wire *returnPort)
+{
+  std::string funcName = getSubFunctionName(submod, returnPort->name);
+
+  std::vector<llvm::Type *> argTypes;
+
+  // Add every module input port. The caller will expect the function args
+  // to be ordered this way - it will not match them by name.
+  for (RTLIL::IdString portname : submod->ports) {
+    RTLIL::Wire *port = submod->wire(portname);
+    log_assert(port);
+    if (port->port_input) {
+      argTypes.push_back(getLlvmType(port));
+    }
+  }
+
+  log_assert (returnPort->port_output && !returnPort->port_input);
+
+  // A return type of the correct width
+  llvm::Type* retTy = llvmWidth(returnPort->width);
 
   llvm::FunctionType *functype =
     llvm::FunctionType::get(retTy, argTypes, false);
@@ -1919,8 +3118,8 @@ LLVMWriter::writeSubFunction(RTLIL::Module *submod,
   log("Generating sub function for module %s port %s\n",
       submod->name.c_str(), returnPortName.c_str());
 
-  finder.build(submod);
-  log("%ld objects in driverFinder\n", finder.size());
+  ownFinder.build(submod);
+  log("%ld objects in driverFinder\n", finder->size());
 
   RTLIL::Wire *returnPort = submod->wire(returnPortName);
   llvmFunc = generateSubFunctionDecl(submod, returnPort);
@@ -1939,7 +3138,7 @@ LLVMWriter::writeSubFunction(RTLIL::Module *submod,
 
   // Collect the drivers of each bit of the return port
   DriverSpec dSpec;
-  finder.buildDriverOf(returnPort, dSpec);
+  finder->buildDriverOf(returnPort, dSpec);
 
   log_debug_driverspec(dSpec);
   log_debug("\n");
@@ -2014,6 +3213,24 @@ LLVMWriter::write_llvm_ir(RTLIL::Module *unrolledRtlMod,
                           std::string funcName)
 {
 
+  generate_llvm_ir(unrolledRtlMod, targetName, targetIsVec, modName, num_cycles, funcName);
+
+  writeModuleFile(llvmFileName);
+}
+
+
+// The first part of write_llvm_ir(): generate the LLVM module, but do not
+// finish or write it.  This reads the Yosys design, so it must be done on
+// the main thread.
+
+void
+LLVMWriter::generate_llvm_ir(RTLIL::Module *unrolledRtlMod,
+                             std::string targetName,  // As specified in allowed_target.txt
+                             bool targetIsVec,       // target is ASV vector
+                             std::string modName,  // from original Verilog, e.g. "M8080"
+                             int num_cycles,
+                             std::string funcName)
+{
   log_assert(!llvmMod);
   llvmMod = new llvm::Module("mod_;_"+modName+"_;_"+targetName, *c);
 
@@ -2033,32 +3250,683 @@ LLVMWriter::write_llvm_ir(RTLIL::Module *unrolledRtlMod,
 
   writeMainFunction(unrolledRtlMod, targetName, targetIsVec, num_cycles, funcName);
 
+  if (opts.jit) {
+    describeForJit(unrolledRtlMod, targetName, targetIsVec, num_cycles);
+  }
+}
+
+
+// The second part: verify the module and do mux-to-branch conversion if
+// requested.  Only this writer's LLVMContext is used, so it is safe to call
+// this on any thread, as long as the writer is not otherwise in use.
+
+void
+LLVMWriter::finish_llvm_ir()
+{
+  log_assert(llvmMod);
+  finishModule(llvmMod);
+}
+
+
+// The last part: give the main function its final name, and write out the
+// module and delete it.
+
+void
+LLVMWriter::write_llvm_file(std::string funcName, std::string llvmFileName)
+{
   log_assert(llvmFunc);
 
+  llvmFunc->setName(funcName);
+  printModule(llvmMod, llvmFileName);
+  writeStateLayout(llvmFileName);
 
-  log("%u LLVM instructions generated\n", llvmMod->getInstructionCount());
+  if (opts.jit) {
+    giveModuleToJit();
+  }
 
-  llvm::verifyModule(*llvmMod);
+  clearFunctionData();
 
+  delete llvmMod;
+  llvmMod = nullptr;
+}
 
-  if (opts.optimize_muxes) {
-    log("Optimizing muxes...\n");
-    BranchMux::convertSelectsToBranches(llvmMod, opts.optimize_mux_threshold);
+
+
+void
+LLVMWriter::write_time_frame_llvm_ir(const TimeFrameInfo& timeFrameInfo,
+                                     std::string targetName,  // As specified in allowed_target.txt
+                                     bool targetIsVec,       // target is ASV vector
+                                     std::string modName,  // from original Verilog, e.g. "M8080"
+                                     std::string llvmFileName,
+                                     std::string funcName)
+{
+  log_assert(!llvmMod);
+  llvmMod = new llvm::Module("mod_;_"+modName+"_;_"+targetName, *c);
+
+  timeFrame = &timeFrameInfo;
+
+  writeTimeFrameFunction(targetName, targetIsVec, funcName);
+
+  writeModuleFile(llvmFileName);
+
+  timeFrame = nullptr;
+}
+
+
+
+// Start multi-target mode for the given unrolled module: create the LLVM
+// module and the (empty) fused function.  The fused function has the same
+// args as a main function, plus a pointer to a byte array that receives the
+// target values.
+
+void
+LLVMWriter::begin_multi_target(RTLIL::Module *unrolledRtlMod,
+                               std::string modName,  // from original Verilog, e.g. "M8080"
+                               int num_cycles,
+                               std::string fusedFuncName,
+                               std::string combinedFileName)
+{
+  log_assert(!llvmMod);
+  log_assert(!opts.support_hierarchy);
+  llvmMod = new llvm::Module("mod_;_"+modName+"_;_"+fusedFuncName, *c);
+
+  clearFunctionData();
+
+  log("Generating fused function %s\n", fusedFuncName.c_str());
+
+  useMainDriverFinder(unrolledRtlMod);
+
+  multiTargetRtlMod = unrolledRtlMod;
+  multiTargetCycles = num_cycles;
+  multiTargetModName = modName;
+  multiTargetFileName = combinedFileName;
+  multiTargetVectors.clear();
+  getTargetVectors(unrolledRtlMod, multiTargetVectors);
+
+  // Declared like a function for a vector target with 8-bit elements.
+  fusedFunc = generateFunctionDecl(fusedFuncName, unrolledRtlMod, multiTargetVectors, -8, 0);
+  fusedFunc->getArg(fusedFunc->arg_size()-1)->setName("outputs");
+  llvmFunc = fusedFunc;
+
+  fusedTail = llvm::BasicBlock::Create(*c, "bb_;_fused", fusedFunc);
+  fusedStores.clear();
+  fusedTargets.clear();
+  fusedSize = 0;
+  fusedBBSwitch.clear();
+  fusedSwitchPost.clear();
+  fusedPostSwitch.clear();
+}
+
+
+// Return a new Module holding a copy of func, and declarations of the
+// functions it calls.  Unlike CloneModule(), this doesn't look at the rest
+// of func's Module, which holds all the target functions so far.
+
+static std::unique_ptr<llvm::Module>
+extractFunction(llvm::Function *func, std::string modName)
+{
+  llvm::Module *srcMod = func->getParent();
+  std::unique_ptr<llvm::Module> mod = std::make_unique<llvm::Module>(modName, func->getContext());
+  mod->setDataLayout(srcMod->getDataLayout());
+  mod->setTargetTriple(srcMod->getTargetTriple());
+
+  llvm::ValueToValueMapTy vmap;
+  for (llvm::BasicBlock& bb : *func) {
+    for (llvm::Instruction& inst : bb) {
+      llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&inst);
+      llvm::Function *callee = call ? call->getCalledFunction() : nullptr;
+      if (callee && !vmap.count(callee)) {
+        vmap[callee] = mod->getOrInsertFunction(callee->getName(), callee->getFunctionType(),
+                                                callee->getAttributes()).getCallee();
+      }
+    }
+  }
+
+  llvm::Function *newFunc = llvm::Function::Create(func->getFunctionType(), func->getLinkage(),
+                                                   func->getName(), mod.get());
+  for (unsigned n = 0; n < func->arg_size(); n++) {
+    newFunc->getArg(n)->setName(func->getArg(n)->getName());
+    vmap[func->getArg(n)] = newFunc->getArg(n);
   }
 
-  std::string Str;
-  llvm::raw_string_ostream OS(Str);
-  OS << *llvmMod;
-  OS.flush();
+  llvm::SmallVector<llvm::ReturnInst*, 1> returns;
+  llvm::CloneFunctionInto(newFunc, func, vmap,
+                          llvm::CloneFunctionChangeType::DifferentModule, returns);
+  return mod;
+}
 
-  std::ofstream output(llvmFileName);
-  output << Str << std::endl;
-  output.close();
+
+// Generate the code for one more target at the end of the fused function,
+// re-using whatever the earlier targets have already generated.  Then derive
+// the target's own function from the fused function, and write it out.
+
+void
+LLVMWriter::add_multi_target(std::string targetName,  // As specified in allowed_target.txt
+                             bool targetIsVec,       // target is ASV vector
+                             std::string llvmFileName,
+                             std::string funcName)
+{
+  log_assert(fusedFunc);
+
+  log("Adding target %s to fused function %s\n", targetName.c_str(),
+      fusedFunc->getName().str().c_str());
+
+  llvmFunc = fusedFunc;
+  b->SetInsertPoint(fusedTail);
+
+  llvm::Value *outputs = fusedFunc->getArg(fusedFunc->arg_size()-1);
+  llvm::Type *byteTy = llvmWidth(8);
+
+  FusedTarget fused;
+  fused.targetName = targetName;
+  fused.funcName = funcName;
+  fused.offset = fusedSize;
+
+  // The target's Value in the fused function (or, for a vector target, the
+  // Value of each element, with its index), and the target's own function.
+  std::vector<std::pair<int, llvm::Value*>> fusedValues;
+  llvm::Function *targetFunc = nullptr;
+
+  if (!targetIsVec) {
+    RTLIL::IdString portName = cycleize_name(targetName, multiTargetCycles+1);
+    RTLIL::Wire *targetPort = multiTargetRtlMod->wire(portName);
+
+    if (!targetPort) {
+      log_error("Can't find output port %s for destination ASV %s\n", portName.c_str(), targetName.c_str());
+      return;
+    }
+    log_assert(targetPort->port_output);
+
+    DriverSpec dSpec;
+    finder->buildDriverOf(targetPort, dSpec);
+
+    llvm::Value *destValue = generateValue(dSpec);
+    fusedValues.push_back({-1, destValue});
+
+    llvm::Type *targetType = getLlvmType(targetPort);
+    llvm::Value *slot = b->CreateBitCast(b->CreateConstGEP1_32(byteTy, outputs, fused.offset),
+                                         llvm::PointerType::getUnqual(targetType));
+    fusedStores.push_back(b->CreateStore(destValue, slot));
+    fused.size = llvmMod->getDataLayout().getTypeAllocSize(targetType).getFixedSize();
+
+    int targetWidth;
+    int targetVecSize;
+    if (llvm::FixedVectorType *vecTy = llvm::dyn_cast<llvm::FixedVectorType>(targetType)) {
+      targetWidth = getWidth(vecTy->getElementType());
+      targetVecSize = vecTy->getNumElements();
+    } else {
+      targetWidth = getWidth(targetType);
+      targetVecSize = 0;
+    }
+
+    targetFunc = generateFunctionDecl(funcName, multiTargetRtlMod, multiTargetVectors,
+                                      targetWidth, targetVecSize);
+  } else {
+    std::string cycleizedTargetName = internalToLLVM(cycleize_name(targetName, multiTargetCycles+1));
+    int elementWidth = 0;
+    llvm::Value *slot = nullptr;
+
+    for (RTLIL::IdString portname : multiTargetRtlMod->ports) {
+      RTLIL::Wire *targetPort = multiTargetRtlMod->wire(portname);
+      if (targetPort->get_string_attribute(TARGET_VECTOR_ATTR) == cycleizedTargetName) {
+
+        int idx = std::stoi(targetPort->get_string_attribute(TARGET_VECTOR_IDX_ATTR));
+        log_assert(targetPort->port_output);
+
+        DriverSpec dSpec;
+        finder->buildDriverOf(targetPort, dSpec);
+
+        llvm::Value *destValue = generateValue(dSpec);
+        fusedValues.push_back({idx, destValue});
+
+        // The slot is laid out like the array a vector target function returns.
+        int paddedWidth = funcExtract::get_padded_width(targetPort->width);
+        if (!slot) {
+          elementWidth = targetPort->width;
+          slot = b->CreateBitCast(b->CreateConstGEP1_32(byteTy, outputs, fused.offset),
+                                  llvm::PointerType::getUnqual(llvmWidth(paddedWidth)));
+        }
+        fusedStores.push_back(generateStore(slot, idx, destValue));
+        fused.size = std::max(fused.size, (idx+1) * paddedWidth/8);
+      }
+    }
+
+    if (!slot) {
+      log_error("Can't find output ports for destination ASV vector %s\n", targetName.c_str());
+      return;
+    }
+
+    targetFunc = generateFunctionDecl(funcName, multiTargetRtlMod, multiTargetVectors,
+                                      -elementWidth, 0);
+  }
+
+  fusedTail = b->GetInsertBlock();
+  fusedSize = (fused.offset + fused.size + 7) & ~7;  // Keep the slots 8-byte aligned
+  fusedTargets.push_back(fused);
+
+  deriveTargetFunction(targetFunc, targetIsVec, fusedValues);
+
+  log("%lu Values in valueCache\n", valueCache.size());
+  log("%lu hits, %lu misses\n", valueCache.nHits(), valueCache.nMisses());
+
+  // Write a module with just the target function, as write_llvm_ir() would.
+  std::unique_ptr<llvm::Module> targetMod =
+      extractFunction(targetFunc, "mod_;_"+multiTargetModName+"_;_"+targetName);
+
+  writeModule(targetMod.get(), llvmFileName);
+  log("LLVM result written to %s\n", llvmFileName.c_str());
+}
+
+
+// Give targetFunc (a declaration with the same args as the fused function,
+// except for the last one) a body: a copy of the part of the fused function
+// that the given Values need, returning them instead of storing them.  The
+// work is proportional to the target's own code, not to the fused function,
+// which grows with every target.
+
+void
+LLVMWriter::deriveTargetFunction(llvm::Function *targetFunc, bool targetIsVec,
+                                 const std::vector<std::pair<int, llvm::Value*>>& fusedValues)
+{
+  unsigned numArgs = fusedFunc->arg_size()-1;
+
+  llvm::ValueToValueMapTy vmap;
+  for (unsigned n = 0; n < numArgs; n++) {
+    vmap[fusedFunc->getArg(n)] = targetFunc->getArg(n);
+  }
+  llvm::Argument *outputs = fusedFunc->getArg(numArgs);
+  vmap[outputs] = llvm::ConstantPointerNull::get(llvm::cast<llvm::PointerType>(outputs->getType()));
+
+  // Find the Instructions that the Values need: their operands, the switch
+  // of each BB they are in, and for a Phi, the switch whose cases it joins.
+  pool<llvm::Instruction*, hash_ptr_ops> needed;
+  std::vector<llvm::Instruction*> worklist;
+  auto need = [&](llvm::Value *val) {
+    llvm::Instruction *inst = llvm::dyn_cast<llvm::Instruction>(val);
+    if (inst && needed.insert(inst).second) {
+      worklist.push_back(inst);
+    }
+  };
+
+  for (auto& idxValue : fusedValues) {
+    need(idxValue.second);
+  }
+  while (!worklist.empty()) {
+    llvm::Instruction *inst = worklist.back();
+    worklist.pop_back();
+    for (llvm::Value *op : inst->operands()) {
+      need(op);
+    }
+    llvm::BasicBlock *bb = inst->getParent();
+    if (llvm::isa<llvm::PHINode>(inst)) {
+      need(fusedPostSwitch.at(bb));
+    }
+    auto it = fusedBBSwitch.find(bb);
+    if (it != fusedBBSwitch.end()) {
+      need(it->second);
+    }
+  }
+
+  // Make the BBs that can still be reached from the entry BB, when each
+  // switch that isn't needed goes straight on to its post BB.
+  std::vector<llvm::BasicBlock*> blocks;
+  auto visit = [&](llvm::BasicBlock *bb) {
+    if (!vmap.count(bb)) {
+      vmap[bb] = llvm::BasicBlock::Create(*c, bb->getName(), targetFunc);
+      blocks.push_back(bb);
+    }
+  };
+
+  visit(&fusedFunc->getEntryBlock());
+  for (size_t n = 0; n < blocks.size(); n++) {
+    llvm::Instruction *term = blocks[n]->getTerminator();
+    if (!term) {
+      log_assert(blocks[n] == fusedTail);
+      continue;
+    }
+    llvm::SwitchInst *switchInst = llvm::dyn_cast<llvm::SwitchInst>(term);
+    if (switchInst && !needed.count(switchInst)) {
+      visit(fusedSwitchPost.at(switchInst));
+    } else {
+      for (llvm::BasicBlock *succ : llvm::successors(term)) {
+        visit(succ);
+      }
+    }
+  }
+
+  // Copy the needed Instructions, keeping their order within each BB.
+  dict<llvm::BasicBlock*, std::vector<llvm::Instruction*>, hash_ptr_ops> blockInsts;
+  for (llvm::Instruction *inst : needed) {
+    if (!inst->isTerminator()) {
+      blockInsts[inst->getParent()].push_back(inst);
+    }
+  }
+
+  std::vector<llvm::Instruction*> clones;
+  for (llvm::BasicBlock *bb : blocks) {
+    llvm::BasicBlock *newBB = llvm::cast<llvm::BasicBlock>(vmap[bb]);
+
+    auto it = blockInsts.find(bb);
+    if (it != blockInsts.end()) {
+      std::vector<llvm::Instruction*>& insts = it->second;
+      std::sort(insts.begin(), insts.end(),
+                [](llvm::Instruction *x, llvm::Instruction *y) { return x->comesBefore(y); });
+      for (llvm::Instruction *inst : insts) {
+        llvm::Instruction *clone = inst->clone();
+        clone->setName(inst->getName());
+        newBB->getInstList().push_back(clone);
+        vmap[inst] = clone;
+        clones.push_back(clone);
+      }
+      blockInsts.erase(it);
+    }
+
+    llvm::Instruction *term = bb->getTerminator();
+    if (!term) {
+      continue;
+    }
+    llvm::SwitchInst *switchInst = llvm::dyn_cast<llvm::SwitchInst>(term);
+    if (switchInst && !needed.count(switchInst)) {
+      llvm::BranchInst::Create(llvm::cast<llvm::BasicBlock>(vmap[fusedSwitchPost.at(switchInst)]),
+                               newBB);
+    } else {
+      llvm::Instruction *clone = term->clone();
+      newBB->getInstList().push_back(clone);
+      clones.push_back(clone);
+    }
+  }
+  log_assert(blockInsts.empty());
+
+  for (llvm::Instruction *clone : clones) {
+    llvm::RemapInstruction(clone, vmap, llvm::RF_NoModuleLevelChanges);
+  }
+
+  b->SetInsertPoint(llvm::cast<llvm::BasicBlock>(vmap[fusedTail]));
+  if (!targetIsVec) {
+    b->CreateRet(llvm::MapValue(fusedValues[0].second, vmap));
+  } else {
+    llvm::Value *returnValueArray = targetFunc->getArg(numArgs);
+    for (auto& idxValue : fusedValues) {
+      generateStore(returnValueArray, idxValue.first, llvm::MapValue(idxValue.second, vmap));
+    }
+    b->CreateRetVoid();
+  }
+
+  // Join up the chains of BBs that the skipped switches left behind.
+  for (llvm::BasicBlock& bb : llvm::make_early_inc_range(*targetFunc)) {
+    llvm::MergeBlockIntoPredecessor(&bb);
+  }
+
+  llvm::verifyFunction(*targetFunc);
+}
+
+
+// Finish the fused function, and write out the LLVM module holding it and all
+// the target functions.
+
+void
+LLVMWriter::finish_multi_target()
+{
+  if (!fusedFunc) {
+    return;
+  }
+
+  b->SetInsertPoint(fusedTail);
+  b->CreateRetVoid();
+
+  if (opts.fused_update) {
+    // Record where each target's value is put in the outputs array.
+    llvm::NamedMDNode *layout = llvmMod->getOrInsertNamedMetadata("func_extract.fused_outputs");
+    for (const FusedTarget& fused : fusedTargets) {
+      layout->addOperand(llvm::MDNode::get(*c, {
+                llvm::MDString::get(*c, fused.targetName),
+                llvm::ConstantAsMetadata::get(llvmInt(fused.offset, 32)),
+                llvm::ConstantAsMetadata::get(llvmInt(fused.size, 32)),
+                llvm::MDString::get(*c, fused.funcName)}));
+    }
+    log("Fused function %s writes %d bytes of outputs\n",
+        fusedFunc->getName().str().c_str(), fusedSize);
+    llvm::verifyFunction(*fusedFunc);
+  } else {
+    fusedFunc->eraseFromParent();
+  }
+
+  if (!fusedTargets.empty()) {
+    log("Writing %zu target functions to %s\n", fusedTargets.size(), multiTargetFileName.c_str());
+    writeModule(llvmMod, multiTargetFileName);
+    log("LLVM result written to %s\n", multiTargetFileName.c_str());
+  }
 
   clearFunctionData();
+  multiTargetRtlMod = nullptr;
+  fusedFunc = nullptr;
+  fusedTail = nullptr;
+  fusedStores.clear();
+  fusedTargets.clear();
+  fusedSize = 0;
+  fusedBBSwitch.clear();
+  fusedSwitchPost.clear();
+  fusedPostSwitch.clear();
 
   delete llvmMod;
+  llvmMod = nullptr;
+}
+
+
+
+// Finish up the main function, write out the LLVM module, and delete it.
+
+void
+LLVMWriter::writeModuleFile(std::string llvmFileName)
+{
+  log_assert(llvmFunc);
+
+  writeModule(llvmMod, llvmFileName);
+  writeStateLayout(llvmFileName);
+
+  if (opts.jit && !timeFrame) {
+    giveModuleToJit();
+  }
+
+  clearFunctionData();
+
+  delete llvmMod;  // Null if given to the JIT
   llvmMod = nullptr;  
 }
 
 
+// Describe the main function's args and result, in the order that
+// generateFunctionDecl() declared them, along with the unrolled module
+// ports that they stand for.
+
+void
+LLVMWriter::describeForJit(RTLIL::Module *unrolledRtlMod, std::string targetName,
+                           bool targetIsVec, int num_cycles)
+{
+  jitInfo = JitFunctionInfo();
+  jitInfo.targetName = targetName;
+  jitInfo.rtlModName = unrolledRtlMod->name;
+
+  for (RTLIL::IdString portname : unrolledRtlMod->ports) {
+    RTLIL::Wire *port = unrolledRtlMod->wire(portname);
+    if (port->port_input && !port->has_attribute(TARGET_VECTOR_ATTR)) {
+      JitValueInfo arg;
+      arg.name = internalToLLVM(portname, true);
+      arg.width = port->width;
+      if (port->has_attribute("\\vector_width")) {
+        arg.width = std::stoi(port->get_string_attribute("\\vector_width"));
+        arg.numElems = std::stoi(port->get_string_attribute("\\vector_size"));
+      }
+      arg.ports.push_back(portname);
+      jitInfo.args.push_back(arg);
+    }
+  }
+
+  Yosys::dict<std::string, unsigned> targetVectors;
+  getTargetVectors(unrolledRtlMod, targetVectors);
+  for (auto& vecNameWidth : targetVectors) {
+    JitValueInfo arg;
+    arg.name = vecNameWidth.first;
+    arg.width = vecNameWidth.second;
+    getJitArrayPorts(unrolledRtlMod, vecNameWidth.first, false, arg);
+    jitInfo.args.push_back(arg);
+  }
+
+  JitValueInfo& result = jitInfo.result;
+  if (!targetIsVec) {
+    RTLIL::Wire *targetPort = unrolledRtlMod->wire(cycleize_name(targetName, num_cycles+1));
+    log_assert(targetPort);
+    result.name = internalToLLVM(targetPort->name, true);
+    result.width = targetPort->width;
+    if (targetPort->has_attribute("\\vector_width")) {
+      result.width = std::stoi(targetPort->get_string_attribute("\\vector_width"));
+      result.numElems = std::stoi(targetPort->get_string_attribute("\\vector_size"));
+    }
+    result.ports.push_back(targetPort->name);
+  } else {
+    result.name = funcExtract::RETURN_ARRAY_PTR_ID;
+    getJitArrayPorts(unrolledRtlMod, internalToLLVM(cycleize_name(targetName, num_cycles+1)),
+                     true, result);
+  }
+}
+
+
+// Fill in the element ports of an ASV array, indexed by their
+// TARGET_VECTOR_IDX_ATTR, and the element width if it is not yet known.
+
+void
+LLVMWriter::getJitArrayPorts(RTLIL::Module *mod, const std::string& vecName,
+                             bool output, JitValueInfo& value)
+{
+  value.isArray = true;
+  value.ports.clear();
+
+  for (RTLIL::IdString portname : mod->ports) {
+    RTLIL::Wire *port = mod->wire(portname);
+    if ((output ? port->port_output : port->port_input) &&
+        port->get_string_attribute(TARGET_VECTOR_ATTR) == vecName) {
+      size_t idx = std::stoi(port->get_string_attribute(TARGET_VECTOR_IDX_ATTR));
+      if (value.ports.size() <= idx) {
+        value.ports.resize(idx+1);
+      }
+      value.ports[idx] = portname;
+      if (value.width == 0) {
+        value.width = port->width;
+      }
+    }
+  }
+
+  value.numElems = value.ports.size();
+}
+
+
+// The JIT takes ownership of the module, along with the context that it
+// belongs to, so this writer continues with a new context.
+
+void
+LLVMWriter::giveModuleToJit()
+{
+  log_assert(llvmFunc);
+  jitInfo.funcName = llvmFunc->getName().str();
+
+  clearFunctionData();
+  b.reset();
+
+  jitAddModule(std::unique_ptr<llvm::Module>(llvmMod), std::move(c), jitInfo);
+  llvmMod = nullptr;
+
+  c = std::make_unique<llvm::LLVMContext>();
+  b = std::make_unique<llvm::IRBuilder<>>(*c);
+}
+
+
+// Write out the given LLVM module, after doing mux-to-branch conversion if
+// requested.
+
+void
+LLVMWriter::writeModule(llvm::Module *mod, std::string llvmFileName)
+{
+  log("%u LLVM instructions generated\n", mod->getInstructionCount());
+
+  if (opts.optimize_muxes) {
+    log("Optimizing muxes...\n");
+  }
+
+  finishModule(mod);
+  printModule(mod, llvmFileName);
+}
+
+
+// BranchMux comes from func_extract, which makes no promise that it is
+// thread-safe, so only one module at a time is converted.
+static std::mutex branchMuxMutex;
+
+
+// No logging here: this may run on a worker thread.  The pass pipeline only
+// touches the module's own LLVMContext, so modules can be optimized in
+// parallel.
+
+void
+LLVMWriter::finishModule(llvm::Module *mod)
+{
+  llvm::verifyModule(*mod);
+
+  if (opts.optimize_muxes) {
+    std::lock_guard<std::mutex> lock(branchMuxMutex);
+    BranchMux::convertSelectsToBranches(mod, opts.optimize_mux_threshold);
+  }
+
+  // Any error is logged later by printModule(), on the main thread.
+  if (!opts.opt_pipeline.empty()) {
+    runPassPipeline(mod, opts.opt_pipeline, backendError);
+  }
+}
+
+
+void
+LLVMWriter::printModule(llvm::Module *mod, std::string llvmFileName)
+{
+  if (opts.bitcode) {
+    // Stream the bitcode straight to the file.  LLVM's IR readers (and the
+    // LLVM tools) recognize bitcode by its contents, whatever the file name.
+    std::error_code ec;
+    llvm::raw_fd_ostream output(llvmFileName, ec, llvm::sys::fs::OF_None);
+    if (ec) {
+      log_error("Cannot write %s: %s\n", llvmFileName.c_str(), ec.message().c_str());
+      return;
+    }
+    llvm::WriteBitcodeToFile(*mod, output);
+  } else {
+    std::string Str;
+    llvm::raw_string_ostream OS(Str);
+    OS << *mod;
+    OS.flush();
+
+    std::ofstream output(llvmFileName);
+    output << Str << std::endl;
+    output.close();
+  }
+
+  if (!backendError.empty()) {
+    log_warning("LLVM optimization failed: %s\n", backendError.c_str());
+    backendError.clear();
+  }
+
+  if (opts.emit_object) {
+    // Replace the extension (if any) with ".o"
+    size_t dot = llvmFileName.find_last_of('.');
+    size_t slash = llvmFileName.find_last_of('/');
+    std::string objFileName = llvmFileName;
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+      objFileName.erase(dot);
+    }
+    objFileName += ".o";
+
+    std::string error;
+    if (emitObjectFile(mod, objFileName, error)) {
+      log("Object file written to %s\n", objFileName.c_str());
+    } else {
+      log_error("Cannot write object file %s: %s\n", objFileName.c_str(), error.c_str());
+    }
+  }
+}
@@ -16,6 +16,7 @@
 #include "kernel/yosys.h"
 
 #include "driver_tools.h"
+#include "jit.h"
 
 class LLVMWriter {
 
@@ -26,11 +27,44 @@ public:
     bool cell_based_llvm_value_names = true;
     bool simplify_and_or_gates = true;
     bool simplify_muxes = true;
+    bool plan_concat = true;
+    bool branch_facts = true;
     bool use_poison = false;
     bool support_hierarchy = false;
     bool support_pmux = false;
     bool optimize_muxes = false;
     int optimize_mux_threshold = -1;
+    bool step_loop = false;
+    bool fused_update = false;
+    bool bitcode = false;
+    std::string opt_pipeline;  // Empty for no in-process optimization
+    bool emit_object = false;
+    bool jit = false;  // Give each finished main function's module to the JIT
+    bool state_struct_abi = false;  // Pass integer scalar args in one state struct
+    ThreadPool *finder_pool = nullptr;  // For building the driver tables of main functions
+  };
+
+  // What is needed to generate an update function directly from the
+  // original (not unrolled) module, evaluating it one cycle (time frame) at a
+  // time.  Cycles are numbered 1 to num_cycles+1, as in an unrolled module.
+  struct TimeFrameInfo {
+    Yosys::RTLIL::Module *srcmod = nullptr;
+    int num_cycles = 0;
+
+    // Indexed by cycle: the values of srcmod input ports, and (in cycle 1)
+    // the initial values of non-ASV registers, by wire name.  Any x bits
+    // of an exposed input become function args, other x bits are undefined.
+    std::vector<Yosys::dict<Yosys::RTLIL::IdString, Yosys::RTLIL::Const>> values;
+    Yosys::pool<Yosys::RTLIL::IdString> exposedInputs;
+
+    // Registers whose initial values are function args.
+    Yosys::pool<Yosys::RTLIL::IdString> targets;
+
+    // Members of ASV register arrays: the array name and index.
+    Yosys::dict<Yosys::RTLIL::IdString, std::pair<std::string, int>> targetVectorMembers;
+
+    // Input that is quietly left undefined in every cycle.
+    Yosys::RTLIL::IdString clock;
   };
 
   LLVMWriter(Yosys::RTLIL::Design *des, const Options& options);
@@ -44,32 +78,144 @@ public:
                       std::string llvmFileName,
                       std::string funcName);
 
+  // write_llvm_ir() in three parts, so that the middle one, which does not
+  // touch the Yosys design, can be run on another thread.  The main function
+  // is renamed to funcName by write_llvm_file().
+  void generate_llvm_ir(Yosys::RTLIL::Module *unrolledRtlMod,
+                        std::string targetName,
+                        bool targetIsVec,
+                        std::string modName,
+                        int num_cycles,
+                        std::string funcName);
+  void finish_llvm_ir();
+  void write_llvm_file(std::string funcName, std::string llvmFileName);
+
+  // Like write_llvm_ir(), but with no unrolled module: the code is generated
+  // by evaluating timeFrame.srcmod cycle by cycle.
+  void write_time_frame_llvm_ir(const TimeFrameInfo& timeFrame,
+                                std::string targetName,
+                                bool targetIsVec,
+                                std::string modName,
+                                std::string llvmFileName,
+                                std::string funcName);
+
+  // Multi-target mode: every target of one unrolled module is generated into
+  // a single fused function that shares one valueCache, so logic common to
+  // several targets is generated only once.  add_multi_target() derives each
+  // target's own function from the fused one and writes it to its own file,
+  // just like write_llvm_ir().  finish_multi_target() writes the LLVM module
+  // holding all the target functions (plus the fused function, if
+  // opts.fused_update is set) to combinedFileName.
+  void begin_multi_target(Yosys::RTLIL::Module *unrolledRtlMod,
+                          std::string modName,  // from original Verilog, e.g. "M8080"
+                          int num_cycles,
+                          std::string fusedFuncName,
+                          std::string combinedFileName);
+
+  void add_multi_target(std::string targetName,  // As specified in allowed_target.txt
+                        bool targetIsVec,       // target is ASV vector
+                        std::string llvmFileName,
+                        std::string funcName);
+
+  void finish_multi_target();
+
   void clearFunctionData();
 
+  // Use the given finder for main functions, instead of one owned by this
+  // writer.  The finder is only re-built when it is not current for the
+  // module being written, so one finder can serve every target of an
+  // unrolled module.
+  void setSharedDriverFinder(DriverFinder *shared) { sharedFinder = shared; }
+
 private:
   class DriverSpecHash {
   public:
     size_t operator() (const DriverSpec& ds) const { return ds.get_hash(); }
   };
 
+  // Maps DriverSpecs to the Values generated for them.  A DriverSpec that
+  // is a single slice of a wire or cell port is keyed by that slice, so
+  // looking it up (or a DriverChunk) needs no temporary DriverSpec.  Any
+  // other DriverSpec is interned on first use and keyed by its handle.
+  // A slice can also be cached "placed": shifted left by destOffset and
+  // zero-extended to totalWidth, as generateChunkValue() makes it.
+  // The keys are in an open-addressing table, and each has a chain of
+  // Values, one per BB that it was generated in.
   class ValueCache {
     public:
       void add(const DriverSpec& driver, llvm::Value *value);
+      void add(const DriverChunk& chunk, llvm::Value *value);
       llvm::Value *find(const DriverSpec& driver, llvm::BasicBlock *bb);
-      void updateDominance() { if (_func) _DT.recalculate(*_func); }
-      void clear() { _mmap.clear(); _nHits = 0; _nMisses = 0; _func = nullptr; _DT.reset(); }
-      size_t size() const { return _mmap.size(); }
+      llvm::Value *find(const DriverChunk& chunk, llvm::BasicBlock *bb);
+      void addPlaced(const DriverChunk& chunk, int destOffset, int totalWidth,
+                     llvm::Value *value);
+      llvm::Value *findPlaced(const DriverChunk& chunk, int destOffset, int totalWidth,
+                              llvm::BasicBlock *bb);
+
+      // CFG edges added to or removed from the function are queued, and
+      // applied to the dominator tree as one incremental batch at the next
+      // dominance query, instead of recalculating the whole tree.  Until
+      // the tree is first needed, there is nothing to update.
+      void insertEdge(llvm::BasicBlock *from, llvm::BasicBlock *to);
+      void deleteEdge(llvm::BasicBlock *from, llvm::BasicBlock *to);
+      void clear();
+      size_t size() const { return _entries.size(); }
       size_t nHits() const { return _nHits; }
       size_t nMisses() const { return _nMisses; }
 
+      // In time-frame mode, values are cached separately for each cycle.
+      // Otherwise everything is in cycle 0.
+      void setCycle(int cycle) { _cycle = cycle; }
+      int cycle() const { return _cycle; }
+
     private:
-      typedef std::unordered_multimap<DriverSpec, llvm::Value*, DriverSpecHash> MmapType;
-      MmapType _mmap;
+      struct Key {
+        const void *object;  // The wire or cell, or null for an interned DriverSpec
+        int port;            // IdString index of a cell port, or the interned handle
+        int offset;
+        int width;
+        int destOffset;  // Zero and width, unless the slice is placed
+        int totalWidth;
+        int cycle;
+
+        bool operator==(const Key& other) const {
+          return object == other.object && port == other.port && offset == other.offset &&
+                 width == other.width && destOffset == other.destOffset &&
+                 totalWidth == other.totalWidth && cycle == other.cycle;
+        }
+      };
+
+      struct Slot {
+        Key key;
+        int head = -1;  // First Entry, or -1 if the slot is empty
+      };
+
+      struct Entry {
+        llvm::Instruction *instr;
+        int next;  // -1 at the end of the chain
+      };
+
+      Key chunkKey(const DriverChunk& chunk, int destOffset, int totalWidth) const;
+      bool driverKey(const DriverSpec& driver, bool intern, Key& key);
+      Slot& findSlot(const Key& key);
+      void grow();
+      llvm::Instruction *addEntry(const Key& key, llvm::Instruction *instr);
+      llvm::Value *findEntry(const Key& key, llvm::BasicBlock *bb);
+
+      std::vector<Slot> _slots;  // The size is zero or a power of two
+      size_t _nKeys = 0;
+      std::vector<Entry> _entries;
+      std::unordered_map<DriverSpec, int, DriverSpecHash> _interned;
+      int _cycle = 0;
 
       size_t _nHits = 0;
       size_t _nMisses = 0;
-      llvm::Function *_func;
+      llvm::Function *_func = nullptr;
       llvm::DominatorTree _DT;
+      bool _DTBuilt = false;
+      std::vector<llvm::DominatorTree::UpdateType> _pendingUpdates;
+
+      llvm::DominatorTree& domTree();
   };
 
 
@@ -80,11 +226,68 @@ private:
   llvm::Function *llvmFunc;  // function being generated
 
   ValueCache valueCache;
-  DriverFinder finder;
+  DriverFinder ownFinder;
+  DriverFinder *sharedFinder = nullptr;
+  DriverFinder *finder = &ownFinder;  // The one in use
   Options opts;
 
+  // Only set in time-frame mode.
+  const TimeFrameInfo *timeFrame = nullptr;
+
+  // While generating a step loop body: its time frame, and the cycle whose
+  // input values it uses.
+  int stepLoopFrame = 0;
+  int stepLoopCycle = 0;
+
+  // The final-cycle register values computed by a step loop.
+  Yosys::dict<Yosys::RTLIL::Cell*, llvm::Value*> stepLoopResults;
+
   int pmuxIdx;
 
+  // While generating a $pmux case BB, the values its select bits must have
+  // there, so values that depend on them fold to constants.  Anything
+  // generated there is cached in the case BB, whose dominated BBs are all
+  // within the case, so no folded value escapes it.
+  Yosys::dict<DriverBit, Yosys::RTLIL::State> branchFacts;
+  Yosys::pool<const void*, Yosys::hashlib::hash_ptr_ops> branchFactObjects;
+
+  // With state_struct_abi, where generateFunctionDecl() put each integer
+  // scalar arg in the main function's state struct, by arg name.
+  struct StateField {
+    int width = 0;   // In bits
+    int offset = 0;  // In bytes
+    int size = 0;    // In bytes, padded
+  };
+  Yosys::dict<std::string, StateField> stateFields;  // In layout order
+  int stateSize = 0;  // In bytes, a whole number of cache lines
+
+  // Multi-target mode state.  The fused function writes each target's
+  // value into its own slot of a byte array, which is its last arg.
+  struct FusedTarget {
+    std::string targetName;
+    std::string funcName;
+    int offset = 0;  // In bytes
+    int size = 0;
+  };
+
+  Yosys::RTLIL::Module *multiTargetRtlMod = nullptr;
+  int multiTargetCycles = 0;
+  std::string multiTargetModName;
+  std::string multiTargetFileName;
+  Yosys::dict<std::string, unsigned> multiTargetVectors;
+  llvm::Function *fusedFunc = nullptr;
+  llvm::BasicBlock *fusedTail = nullptr;  // Unterminated until finished
+  std::vector<llvm::StoreInst*> fusedStores;
+  std::vector<FusedTarget> fusedTargets;
+  int fusedSize = 0;
+
+  // The $pmux switches of the fused function, for deriveTargetFunction():
+  // the switch that each BB is inside of (top-level BBs are not listed), the
+  // post BB that each switch leads to, and the switch of each post BB.
+  Yosys::dict<llvm::BasicBlock*, llvm::SwitchInst*, Yosys::hashlib::hash_ptr_ops> fusedBBSwitch;
+  Yosys::dict<llvm::SwitchInst*, llvm::BasicBlock*, Yosys::hashlib::hash_ptr_ops> fusedSwitchPost;
+  Yosys::dict<llvm::BasicBlock*, llvm::SwitchInst*, Yosys::hashlib::hash_ptr_ops> fusedPostSwitch;
+
 
   llvm::IntegerType *llvmWidth(unsigned a);
 
@@ -107,6 +310,10 @@ private:
   // Generate a value for a primary input 
   llvm::Value *generatePrimaryInputValue(Yosys::RTLIL::Wire *port);
 
+  // The value of the main function's scalar arg with the given name, which
+  // is loaded from the state struct if it is there.
+  llvm::Value *generateArgValue(const std::string& argname);
+
   // Find or create a Value representing what drives the given input port of the given cell.
   llvm::Value *generateInputValue(Yosys::RTLIL::Cell *cell,
                                   Yosys::RTLIL::IdString port);
@@ -114,7 +321,7 @@ private:
   llvm::Value* generateLoad(llvm::Value *array, unsigned elementWidth, unsigned idx,
                              std::string valueName);
 
-  void generateStore(llvm::Value *array, unsigned idx, llvm::Value *val);
+  llvm::StoreInst *generateStore(llvm::Value *array, unsigned idx, llvm::Value *val);
 
   // Helpers for generateCellOutputValue() below
   llvm::Value *generateSimplifiedAndCellOutputValue(llvm::Value *valA, llvm::Value *valB);
@@ -130,6 +337,21 @@ private:
 
   llvm::Value *generateFFCellOutputValue(Yosys::RTLIL::Cell *cell);
 
+  // Time-frame mode versions of generatePrimaryInputValue() and
+  // generateFFCellOutputValue().  Both depend on the current cycle.
+  llvm::Value *generateTimeFrameWireValue(Yosys::RTLIL::Wire *wire);
+  llvm::Value *generateTimeFrameFFOutputValue(Yosys::RTLIL::Cell *cell);
+  llvm::Value *generateFFNextStateValue(Yosys::RTLIL::Cell *cell);
+  int inputCycle();
+
+  void generateStepLoop(const std::vector<Yosys::RTLIL::Wire*>& targetWires);
+
+  llvm::Value *generateSigValue(const Yosys::RTLIL::SigSpec& sig);
+  llvm::Value *generateSelect(llvm::Value *cond, llvm::Value *valTrue, llvm::Value *valFalse);
+
+  // In time-frame mode, add the current cycle to the given name.
+  Yosys::RTLIL::IdString frameName(Yosys::RTLIL::IdString name);
+
   llvm::Value *
   generateUserDefinedCellOutputValue(Yosys::RTLIL::Cell *cell,
                                      Yosys::RTLIL::IdString port);
@@ -151,6 +373,33 @@ private:
 
   llvm::Value *generateValue(const DriverSpec& dSpec);
 
+  // Append the values branchFacts gives the chunk's bits, LSB first.
+  // Returns false if they are not all known.
+  bool getBranchFacts(const DriverChunk& chunk,
+                      std::vector<Yosys::RTLIL::State>& bits);
+
+  // Generate a concatenation of object slices that amounts to one LLVM
+  // operation on a slice of one or two objects: a plain slice, a sign
+  // extension, a bit or byte reversal, or a funnel shift (which includes
+  // rotations).  Returns null if dSpec is not one of these.
+  llvm::Value *generatePlannedConcat(const DriverSpec& dSpec);
+
+  // generateValue() recurses once per netlist level, which can be tens of
+  // thousands of levels in a deep unrolling.  When the stack is close to
+  // running out, the recursion continues on a new stack segment allocated
+  // from the heap, so there is no depth limit and the generated code is
+  // exactly the same.  Only with glibc, see USE_STACK_SEGMENTS.
+  llvm::Value *generateValueOnNewStack(const DriverSpec& dSpec);
+  static void stackSegmentEntry();
+
+  const char *stackLow = nullptr;  // Lowest usable address of the current stack
+  bool stackLowKnown = false;
+
+  // The stack segments allocated so far, kept for re-use by later deep
+  // recursions.  The first stackSegmentsInUse of them are in use.
+  std::vector<std::unique_ptr<char[]>> stackSegments;
+  size_t stackSegmentsInUse = 0;
+
 
   // The wire represents a target ASV, and is not NOT necessarily a port
   llvm::Value *generateDestValue(Yosys::RTLIL::Wire *wire);
@@ -162,6 +411,23 @@ private:
                        const Yosys::dict<std::string, unsigned>& targetVectors,
                        int retWidth, int retVecSize);
 
+  llvm::Function*
+  generateFunctionDecl(const std::string& funcName,
+                       const std::vector<std::pair<std::string, llvm::Type*>>& scalarArgs,
+                       const Yosys::dict<std::string, unsigned>& targetVectors,
+                       int retWidth, int retVecSize);
+
+  void layoutStateStruct(const std::vector<std::pair<std::string, llvm::Type*>>& scalarArgs);
+  void writeStateLayout(const std::string& llvmFileName);
+
+  void useMainDriverFinder(Yosys::RTLIL::Module *mod);
+
+  void getTargetVectors(Yosys::RTLIL::Module *mod,
+                        Yosys::dict<std::string, unsigned>& targetVectors);
+
+  void deriveTargetFunction(llvm::Function *targetFunc, bool targetIsVec,
+                            const std::vector<std::pair<int, llvm::Value*>>& fusedValues);
+
   llvm::Function*
   writeMainFunction(Yosys::RTLIL::Module *unrolledRtlMod,
                     std::string targetName,  // As specified in allowed_target.txt
@@ -169,6 +435,29 @@ private:
                     int num_cycles,
                     std::string funcName);
 
+  llvm::Function*
+  writeTimeFrameFunction(std::string targetName,  // As specified in allowed_target.txt
+                         bool targetIsVec,       // target is ASV vector
+                         std::string funcName);
+
+  void writeModuleFile(std::string llvmFileName);
+  void writeModule(llvm::Module *mod, std::string llvmFileName);
+  void finishModule(llvm::Module *mod);
+  void printModule(llvm::Module *mod, std::string llvmFileName);
+
+  // Set by finishModule(), which may run on a worker thread.
+  std::string backendError;
+
+  // With opts.jit, what the JIT needs to know about the main function
+  // generated by generate_llvm_ir().  giveModuleToJit() hands the module
+  // and its context over, and starts a new context for this writer.
+  JitFunctionInfo jitInfo;
+  void describeForJit(Yosys::RTLIL::Module *unrolledRtlMod, std::string targetName,
+                      bool targetIsVec, int num_cycles);
+  void getJitArrayPorts(Yosys::RTLIL::Module *mod, const std::string& vecName,
+                        bool output, JitValueInfo& value);
+  void giveModuleToJit();
+
   bool isProperSubModule(Yosys::RTLIL::Module *mod);
 
   llvm::Function*
@@ -35,6 +35,7 @@
 #include "unroll.h"
 #include "write_llvm.h"
 #include "uf_generator.h"
+#include "llvm_backend.h"
 
 #include "kernel/register.h"
 #include "kernel/celltypes.h"
@@ -44,9 +45,15 @@
 #include "kernel/mem.h"
 #include <string>
 #include <sstream>
+#include <fstream>
 #include <set>
 #include <map>
 
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
 
 USING_YOSYS_NAMESPACE
 PRIVATE_NAMESPACE_BEGIN
@@ -54,6 +61,221 @@ PRIVATE_NAMESPACE_BEGIN
 
 
 
+// The directory in which worker process n writes its results.
+static std::string workerPath(const std::string& path, int n)
+{
+  return path + "/.func_extract_worker_" + std::to_string(n);
+}
+
+
+static bool isWorkerDir(const std::string& filename)
+{
+  return filename.compare(0, 22, ".func_extract_worker_") == 0;
+}
+
+
+static bool isTextFile(const std::string& filename)
+{
+  return filename.size() > 4 && filename.substr(filename.size()-4) == ".txt";
+}
+
+
+static bool isSymlink(const std::string& filename)
+{
+  struct stat st;
+  return lstat(filename.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+}
+
+
+// The names of the files in the given directory, in sorted order.
+static std::vector<std::string> readDirectory(const std::string& dirname)
+{
+  std::vector<std::string> filenames;
+
+  DIR *dir = opendir(dirname.c_str());
+  if (!dir) {
+    log_error("Cannot read directory %s\n", dirname.c_str());
+    return filenames;
+  }
+  while (struct dirent *entry = readdir(dir)) {
+    std::string filename = entry->d_name;
+    if (filename != "." && filename != "..") {
+      filenames.push_back(filename);
+    }
+  }
+  closedir(dir);
+
+  std::sort(filenames.begin(), filenames.end());
+  return filenames;
+}
+
+
+// Remove a worker directory.  Its symlinks are removed first, since
+// remove_directory() would follow a link to a directory and empty it.
+static void removeWorkerDirectory(const std::string& dirname)
+{
+  for (const std::string& filename : readDirectory(dirname)) {
+    std::string name = dirname + "/" + filename;
+    if (isSymlink(name)) {
+      remove(name.c_str());
+    }
+  }
+  remove_directory(dirname);
+}
+
+
+// Make the directory of worker n look like the output directory path: the
+// text files there (e.g. func_info.txt) are copied, and everything else is
+// linked.  So the flow reads the real inputs, and its checks for existing
+// outputs see the real outputs, while the text files it appends to and any
+// new files stay private to the worker.  textSizes gets the size of each
+// copied text file.
+static void makeWorkerDirectory(const std::string& path, int n,
+                                dict<std::string, size_t>& textSizes)
+{
+  std::string dirname = workerPath(path, n);
+  if (check_directory_exists(dirname)) {
+    removeWorkerDirectory(dirname);
+  }
+  if (!create_directory(dirname)) {
+    log_error("Cannot create worker directory %s\n", dirname.c_str());
+  }
+
+  for (const std::string& filename : readDirectory(path)) {
+    if (isWorkerDir(filename)) {
+      continue;
+    }
+    std::string src = path + "/" + filename;
+    std::string dest = dirname + "/" + filename;
+    if (isTextFile(filename) && !check_directory_exists(src)) {
+      std::ifstream input(src, std::ios::binary);
+      std::ofstream output(dest, std::ios::binary);
+      if (input.peek() != std::ifstream::traits_type::eof()) {
+        output << input.rdbuf();
+      }
+      textSizes[filename] = output.tellp();
+    } else if (symlink(("../" + filename).c_str(), dest.c_str()) != 0) {
+      log_error("Cannot link %s into worker directory %s\n", src.c_str(), dirname.c_str());
+    }
+  }
+}
+
+
+// Move the results of worker process n into the given directory.  What the
+// worker appended to a text file (e.g. func_info.txt), or the whole of a new
+// text file, is appended to the real one.  Other new files are moved, and
+// links to the real files are dropped.  The caller must merge the workers in
+// instruction order.
+static void mergeWorkerResults(const std::string& path, int n,
+                               const dict<std::string, size_t>& textSizes)
+{
+  std::string dirname = workerPath(path, n);
+
+  for (const std::string& filename : readDirectory(dirname)) {
+    std::string src = dirname + "/" + filename;
+    std::string dest = path + "/" + filename;
+    if (isSymlink(src)) {
+      remove(src.c_str());
+    } else if (isTextFile(filename)) {
+      std::ifstream input(src, std::ios::binary);
+      auto it = textSizes.find(filename);
+      if (it != textSizes.end()) {
+        input.seekg(0, std::ios::end);
+        if ((size_t)input.tellg() < it->second) {
+          log_warning("Worker %d shortened %s, appending all of it\n", n, filename.c_str());
+          input.seekg(0);
+        } else {
+          input.seekg(it->second);
+        }
+      }
+      std::ofstream output(dest, std::ios::binary | std::ios::app);
+      if (input.peek() != std::ifstream::traits_type::eof()) {
+        output << input.rdbuf();
+      }
+      input.close();
+      remove(src.c_str());
+    } else if (rename(src.c_str(), dest.c_str()) != 0) {
+      log_warning("Cannot move worker result %s to %s\n", src.c_str(), dest.c_str());
+    }
+  }
+
+  removeWorkerDirectory(dirname);
+}
+
+
+// Run the flow in the given number of forked worker processes.  Each worker
+// inherits the loaded design, handles a contiguous block of the instructions,
+// and writes its results into its own directory.  Once all the workers are
+// done, their results are merged in worker order, which is the order a
+// serial run would have written them in.
+static void runWorkers(funcExtract::FuncExtractFlow& flow, YosysUFGenFactory& factory,
+                       int jobs)
+{
+  std::string path = taintGen::g_path;
+  int numInstrs = GetSize(funcExtract::g_instrInfo);
+  jobs = std::min(jobs, numInstrs);
+
+  log("Running func_extract for %d instructions in %d worker processes\n", numInstrs, jobs);
+  log_flush();
+
+  dict<std::string, size_t> textSizes;
+  for (int n = 0; n < jobs; ++n) {
+    makeWorkerDirectory(path, n, textSizes);
+  }
+
+  std::vector<pid_t> pids;
+  for (int n = 0; n < jobs; ++n) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      log_error("Cannot fork worker process %d\n", n);
+    }
+
+    if (pid == 0) {
+      // A worker must always end here.  An exception escaping it would
+      // carry on in the worker's copy of the Yosys command loop.
+      try {
+        // Keep only this worker's share of the instructions.
+        int begin = (int)((int64_t)numInstrs * n / jobs);
+        int end = (int)((int64_t)numInstrs * (n+1) / jobs);
+        decltype(funcExtract::g_instrInfo) instrs(funcExtract::g_instrInfo.begin() + begin,
+                                                  funcExtract::g_instrInfo.begin() + end);
+        funcExtract::g_instrInfo.swap(instrs);
+        taintGen::g_path = workerPath(path, n);
+
+        flow.get_all_update();
+        factory.finish();
+      } catch (...) {
+        log_flush();
+        _exit(1);
+      }
+
+      log_flush();
+      _exit(0);
+    }
+
+    pids.push_back(pid);
+  }
+
+  bool failed = false;
+  for (int n = 0; n < jobs; ++n) {
+    int status = 0;
+    if (waitpid(pids[n], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      log_warning("Worker process %d failed\n", n);
+      failed = true;
+    }
+  }
+
+  for (int n = 0; n < jobs; ++n) {
+    mergeWorkerResults(path, n, textSizes);
+  }
+
+  if (failed) {
+    log_error("Some func_extract worker processes failed\n");
+  }
+}
+
+
+
 struct FuncExtractCmd : public Pass {
 
   FuncExtractCmd() : Pass("func_extract", "Generate ILA update functions") { }
@@ -92,6 +314,18 @@ struct FuncExtractCmd : public Pass {
     log("        This will prevent the LLVM code generator from doing simple\n");
     log("        optimizations on muxes. Possibly useful for debugging.\n");
     log("\n");
+    log("    -no_plan_concat\n");
+    log("        Always generate concatenations of signals by shifting and OR-ing\n");
+    log("        their pieces, instead of recognizing slices, sign extensions, bit\n");
+    log("        and byte reversals and rotations, and generating a single LLVM\n");
+    log("        operation for them. Possibly useful for debugging.\n");
+    log("\n");
+    log("    -no_branch_facts\n");
+    log("        With -pmux, generate the code in each switch case without using\n");
+    log("        the select value that the case implies, which otherwise lets\n");
+    log("        logic that depends on it be folded to constants. Possibly useful\n");
+    log("        for debugging.\n");
+    log("\n");
     log("    -pre_opto_mux_to_branch\n");
     log("        Activate the mux-to-branch pass immediately after LLVM code generation.\n");
     log("        This will try to convert LLVM 'select' instructions (typically created.\n");
@@ -144,6 +378,97 @@ struct FuncExtractCmd : public Pass {
     log("        Typically this gives no improvement, and can interfere with\n");
     log("        mux-to-branch conversion.\n");
     log("\n");
+    log("    -coi_unroll\n");
+    log("        Unroll only the cone of influence of the target ASVs listed in\n");
+    log("        'allowed_target.txt': in each cycle, only the logic that can affect\n");
+    log("        the final-cycle ASV values is copied. This can greatly reduce the size\n");
+    log("        of the unrolled designs and the time needed to optimize them.\n");
+    log("\n");
+    log("    -fold_constants\n");
+    log("        While unrolling, propagate the constant instruction encoding, NOP\n");
+    log("        and non-ASV reset values through the design, and do not copy\n");
+    log("        the logic that they make constant (or make a mux select just one\n");
+    log("        input). Each instruction is then unrolled from scratch, instead of\n");
+    log("        being copied from a cached unrolling.\n");
+    log("\n");
+    log("    -time_frame\n");
+    log("        Do not build an unrolled module. Instead, generate the LLVM IR\n");
+    log("        directly from the original module, evaluating it one cycle at a\n");
+    log("        time with the instruction encoding values substituted, and leave\n");
+    log("        the cleanup to LLVM optimization. Memories and hierarchical\n");
+    log("        designs are not supported, and '$pmux' cells are always translated\n");
+    log("        to LLVM 'switch' instructions.\n");
+    log("\n");
+    log("    -step_loop\n");
+    log("        Implies -time_frame. If the final cycles of an instruction (typically\n");
+    log("        its NOP cycles) all have the same input values, generate the\n");
+    log("        single-cycle next-state logic once, inside an LLVM loop that runs\n");
+    log("        once per such cycle, instead of generating a copy for every cycle.\n");
+    log("\n");
+    log("    -multi_target\n");
+    log("        Generate all the target ASVs of an instruction together, sharing the\n");
+    log("        LLVM code for the logic they have in common. Each target function is\n");
+    log("        still written to its own file, and all of them are also written to\n");
+    log("        the file '<instr_name>_all.ll'. Cannot be used with -time_frame or\n");
+    log("        -support_hierarchy.\n");
+    log("\n");
+    log("    -fused_update\n");
+    log("        Implies -multi_target. Also put the function '<instr_name>_all' in\n");
+    log("        '<instr_name>_all.ll'. It calculates every target ASV in one call,\n");
+    log("        writing the values into a byte array that is described by the\n");
+    log("        'func_extract.fused_outputs' metadata.\n");
+    log("\n");
+    log("    -bitcode\n");
+    log("        Write the LLVM update functions as LLVM bitcode instead of textual\n");
+    log("        LLVM IR. The file names do not change; LLVM tools recognize bitcode by\n");
+    log("        its contents. This is much faster to write and to read back for\n");
+    log("        large functions. With -multi_target, the combined file is named\n");
+    log("        '<instr_name>_all.bc'.\n");
+    log("\n");
+    log("    -opt_pipeline <pipeline>\n");
+    log("        Optimize each LLVM module in-process before writing it, with the\n");
+    log("        given LLVM pass pipeline in 'opt -passes=...' syntax, e.g.\n");
+    log("        'default<O3>'. The code is optimized for the host machine.\n");
+    log("\n");
+    log("    -emit_object\n");
+    log("        Also compile each LLVM module in-process to a native object file for\n");
+    log("        the host machine. It is written next to the LLVM file, with the\n");
+    log("        extension replaced by '.o'.\n");
+    log("\n");
+    log("    -jit\n");
+    log("        Also compile each update function in-process with the LLVM ORC JIT,\n");
+    log("        so that it can be run and checked against the unrolled module with\n");
+    log("        the func_extract_eval command. Cannot be used with -multi_target,\n");
+    log("        -time_frame or -jobs.\n");
+    log("\n");
+    log("    -state_struct_abi\n");
+    log("        Instead of one arg per scalar input, pass the integer inputs of each\n");
+    log("        update function in a packed struct, aligned to a 64-byte cache line,\n");
+    log("        through a pointer arg named '*STATE_STRUCT_PTR*' that comes first.\n");
+    log("        The function only loads the fields it uses. The struct layout is\n");
+    log("        written next to the LLVM file, with the extension replaced by\n");
+    log("        '.state.txt'. Cannot be used with -multi_target or -jit.\n");
+    log("\n");
+    log("    -threads <n>\n");
+    log("        As soon as the unrolled module of an instruction is ready, generate\n");
+    log("        the LLVM for the target ASVs it writes, each with its own LLVM\n");
+    log("        context, and run -opt_pipeline on them in a pool of n threads. The\n");
+    log("        code generation itself reads the Yosys design, so it is still done\n");
+    log("        by the main thread, and pre-opto mux-to-branch conversion is done\n");
+    log("        one module at a time. Without -opt_pipeline there is nothing worth\n");
+    log("        doing in parallel, so the targets are written one at a time as\n");
+    log("        usual. Cannot be used with -multi_target or -time_frame. The driver\n");
+    log("        tables of each unrolled module are also built with n threads.\n");
+    log("\n");
+    log("    -jobs <n>\n");
+    log("        Divide the instructions into n blocks, handled by forked worker\n");
+    log("        processes which run in parallel. Each worker writes its results into\n");
+    log("        a temporary directory that mirrors the output directory, so existing\n");
+    log("        outputs are skipped as usual. When all are done the results are\n");
+    log("        merged in instruction order: what the workers appended to text files\n");
+    log("        such as 'func_info.txt' is appended to the real ones, and the other\n");
+    log("        new files are moved into place.\n");
+    log("\n");
     log("    -path <path>\n");
     log("        Read and write all data and configuration files from the given\n");
     log("        directory path. By default the current directory is used.\n");
@@ -169,6 +494,7 @@ struct FuncExtractCmd : public Pass {
 
     bool read_rst = true;
     bool overwrite = false;
+    int jobs = 1;
 
     YosysUFGenerator::Options ufGenOpts;
     ufGenOpts.save_unrolled = false;
@@ -177,11 +503,25 @@ struct FuncExtractCmd : public Pass {
     ufGenOpts.cell_based_llvm_value_names = false;
     ufGenOpts.simplify_and_or_gates = true;
     ufGenOpts.simplify_muxes = true;
+    ufGenOpts.plan_concat = true;
+    ufGenOpts.branch_facts = true;
     ufGenOpts.use_poison = false;
     ufGenOpts.support_hierarchy = false;
     ufGenOpts.support_pmux = false;
     ufGenOpts.optimize_muxes = false;
     ufGenOpts.optimize_mux_threshold = -1;
+    ufGenOpts.coi_unroll = false;
+    ufGenOpts.fold_constants = false;
+    ufGenOpts.time_frame = false;
+    ufGenOpts.step_loop = false;
+    ufGenOpts.multi_target = false;
+    ufGenOpts.fused_update = false;
+    ufGenOpts.threads = 1;
+    ufGenOpts.bitcode = false;
+    ufGenOpts.opt_pipeline = "";
+    ufGenOpts.emit_object = false;
+    ufGenOpts.jit = false;
+    ufGenOpts.state_struct_abi = false;
 
     size_t argidx;
     for (argidx = 1; argidx < args.size(); argidx++) {
@@ -197,6 +537,10 @@ struct FuncExtractCmd : public Pass {
         ufGenOpts.simplify_and_or_gates = false;
       } else if (arg == "-no_simplify_muxes") {
         ufGenOpts.simplify_muxes = false;
+      } else if (arg == "-no_plan_concat") {
+        ufGenOpts.plan_concat = false;
+      } else if (arg == "-no_branch_facts") {
+        ufGenOpts.branch_facts = false;
       } else if (arg == "-pre_opto_mux_to_branch") {
         ufGenOpts.optimize_muxes = true;
       } else if (arg == "-post_opto_mux_to_branch") {
@@ -213,6 +557,37 @@ struct FuncExtractCmd : public Pass {
         ufGenOpts.support_hierarchy = true;
       } else if (arg == "-pmux") {
         ufGenOpts.support_pmux = true;
+      } else if (arg == "-coi_unroll") {
+        ufGenOpts.coi_unroll = true;
+      } else if (arg == "-fold_constants") {
+        ufGenOpts.fold_constants = true;
+      } else if (arg == "-time_frame") {
+        ufGenOpts.time_frame = true;
+      } else if (arg == "-step_loop") {
+        ufGenOpts.time_frame = true;
+        ufGenOpts.step_loop = true;
+      } else if (arg == "-multi_target") {
+        ufGenOpts.multi_target = true;
+      } else if (arg == "-fused_update") {
+        ufGenOpts.multi_target = true;
+        ufGenOpts.fused_update = true;
+      } else if (arg == "-bitcode") {
+        ufGenOpts.bitcode = true;
+      } else if (arg == "-opt_pipeline" && argidx < args.size()-1) {
+        ++argidx;
+        ufGenOpts.opt_pipeline = args[argidx];
+      } else if (arg == "-emit_object") {
+        ufGenOpts.emit_object = true;
+      } else if (arg == "-jit") {
+        ufGenOpts.jit = true;
+      } else if (arg == "-state_struct_abi") {
+        ufGenOpts.state_struct_abi = true;
+      } else if (arg == "-threads" && argidx < args.size()-1) {
+        ++argidx;
+        ufGenOpts.threads = std::stoi(args[argidx]);
+      } else if (arg == "-jobs" && argidx < args.size()-1) {
+        ++argidx;
+        jobs = std::stoi(args[argidx]);
       } else if (arg == "-path" && argidx < args.size()-1) {
         ++argidx;
         taintGen::g_path = args[argidx];
@@ -228,6 +603,26 @@ struct FuncExtractCmd : public Pass {
     }
     //extra_args(args, argidx, design);  // can handle selection, etc.
 
+    if (ufGenOpts.multi_target && (ufGenOpts.time_frame || ufGenOpts.support_hierarchy)) {
+      log_cmd_error("-multi_target cannot be used with -time_frame, -step_loop or -support_hierarchy.\n");
+    }
+    std::string pipelineError;
+    if (!ufGenOpts.opt_pipeline.empty() &&
+        !checkPassPipeline(ufGenOpts.opt_pipeline, pipelineError)) {
+      log_cmd_error("Invalid -opt_pipeline '%s': %s\n", ufGenOpts.opt_pipeline.c_str(),
+                    pipelineError.c_str());
+    }
+    if (ufGenOpts.threads > 1 && (ufGenOpts.multi_target || ufGenOpts.time_frame)) {
+      log_cmd_error("-threads cannot be used with -multi_target, -time_frame or -step_loop.\n");
+    }
+    if (ufGenOpts.jit && (ufGenOpts.multi_target || ufGenOpts.time_frame || jobs > 1)) {
+      // Worker processes would take their JIT-compiled functions with them.
+      log_cmd_error("-jit cannot be used with -multi_target, -time_frame, -step_loop or -jobs.\n");
+    }
+    if (ufGenOpts.state_struct_abi && (ufGenOpts.multi_target || ufGenOpts.jit)) {
+      log_cmd_error("-state_struct_abi cannot be used with -multi_target or -jit.\n");
+    }
+
     funcExtract::read_config(taintGen::g_path+"/config.txt");
 
     // Override settings from config.txt
@@ -287,7 +682,12 @@ struct FuncExtractCmd : public Pass {
                                       false /*reverseCycleOrder*/);
 
     // Go do the work
-    flow.get_all_update();
+    if (jobs > 1) {
+      runWorkers(flow, factory, jobs);
+    } else {
+      flow.get_all_update();
+      factory.finish();
+    }
   }
 
 } FuncExtractCmd;